@@ -0,0 +1,245 @@
+#define _GNU_SOURCE
+#include "affinity.h"
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Nodes a memory policy can name
+#define MAX_NODES 64
+
+struct cpu_info {
+    int cpu;
+    int package;
+    int core;
+    int core_rank;  /* index of the core among its package's cores */
+    int sibling;    /* index of the CPU among its core's hyperthreads */
+};
+
+// @return the number in the sysfs file at path, def if there is none
+static int read_int(const char *path, int def) {
+    FILE *f = fopen(path, "r");
+    int v;
+
+    if (f == NULL)
+        return def;
+    if (fscanf(f, "%d", &v) != 1)
+        v = def;
+    fclose(f);
+    return v;
+}
+
+static int topology(int cpu, const char *what, int def) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, what);
+    return read_int(path, def);
+}
+
+static int is_allowed(const struct affinity *a, int cpu) {
+    for (int i = 0; i < a->num_allowed; i++)
+        if (a->allowed[i] == cpu)
+            return 1;
+    return 0;
+}
+
+static int by_compact(const void *x, const void *y) {
+    const struct cpu_info *a = x, *b = y;
+    if (a->package != b->package)
+        return a->package - b->package;
+    if (a->core != b->core)
+        return a->core - b->core;
+    return a->cpu - b->cpu;
+}
+
+static int by_scatter(const void *x, const void *y) {
+    const struct cpu_info *a = x, *b = y;
+    if (a->sibling != b->sibling)
+        return a->sibling - b->sibling;
+    if (a->core_rank != b->core_rank)
+        return a->core_rank - b->core_rank;
+    if (a->package != b->package)
+        return a->package - b->package;
+    return a->cpu - b->cpu;
+}
+
+// Order the allowed CPUs for a compact or scatter placement
+static void order_cpus(struct affinity *a) {
+    static struct cpu_info info[AFFINITY_MAX_CPUS];
+    int n = a->num_allowed;
+
+    for (int i = 0; i < n; i++) {
+        info[i].cpu = a->allowed[i];
+        info[i].package = topology(info[i].cpu, "physical_package_id", 0);
+        info[i].core = topology(info[i].cpu, "core_id", info[i].cpu);
+    }
+    for (int i = 0; i < n; i++) {
+        info[i].core_rank = 0;
+        info[i].sibling = 0;
+        for (int j = 0; j < n; j++) {
+            if (info[j].package != info[i].package)
+                continue;
+            // Count distinct cores below ours once, through their first CPU
+            if (info[j].core < info[i].core) {
+                int first = 1;
+                for (int l = 0; l < j; l++)
+                    if (info[l].package == info[j].package && info[l].core == info[j].core)
+                        first = 0;
+                info[i].core_rank += first;
+            }
+            if (info[j].core == info[i].core && info[j].cpu < info[i].cpu)
+                info[i].sibling++;
+        }
+    }
+    qsort(info, n, sizeof(struct cpu_info),
+            a->policy == AFFINITY_COMPACT ? by_compact : by_scatter);
+    for (int i = 0; i < n; i++)
+        a->cpus[i] = info[i].cpu;
+    a->num_cpus = n;
+}
+
+// Parse a list like "0-3,8" into a->cpus, keeping only allowed CPUs
+static int parse_list(struct affinity *a, const char *spec) {
+    const char *p = spec;
+    char *end;
+
+    a->num_cpus = 0;
+    while (*p) {
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p)
+            return -1;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo)
+                return -1;
+        }
+        for (long cpu = lo; cpu <= hi; cpu++)
+            if (is_allowed(a, cpu) && a->num_cpus < AFFINITY_MAX_CPUS)
+                a->cpus[a->num_cpus++] = cpu;
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return -1;
+        p = end;
+    }
+    return 0;
+}
+
+int affinity_parse(struct affinity *a, const char *spec) {
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set))
+        return -1;
+    a->num_allowed = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && a->num_allowed < AFFINITY_MAX_CPUS; cpu++)
+        if (CPU_ISSET(cpu, &set))
+            a->allowed[a->num_allowed++] = cpu;
+
+    if (!strcmp(spec, "compact") || !strcmp(spec, "scatter")) {
+        a->policy = spec[0] == 'c' ? AFFINITY_COMPACT : AFFINITY_SCATTER;
+        order_cpus(a);
+    } else {
+        a->policy = AFFINITY_LIST;
+        if (parse_list(a, spec) < 0)
+            return -1;
+    }
+    return a->num_cpus ? 0 : -1;
+}
+
+int affinity_cpu(const struct affinity *a, int i) {
+    return a->policy == AFFINITY_NONE ? -1 : a->cpus[i % a->num_cpus];
+}
+
+int affinity_pin(const struct affinity *a, int i) {
+    cpu_set_t set;
+
+    if (a->policy == AFFINITY_NONE)
+        return 0;
+    CPU_ZERO(&set);
+    CPU_SET(affinity_cpu(a, i), &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) ? -1 : 0;
+}
+
+void affinity_unpin(const struct affinity *a) {
+    cpu_set_t set;
+
+    if (a->policy == AFFINITY_NONE)
+        return;
+    CPU_ZERO(&set);
+    for (int i = 0; i < a->num_allowed; i++)
+        CPU_SET(a->allowed[i], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+int affinity_node(int cpu) {
+    char path[64];
+    struct dirent *e;
+    DIR *d;
+    int node = 0;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    if ((d = opendir(path)) == NULL)
+        return 0;
+    while ((e = readdir(d)) != NULL)
+        if (sscanf(e->d_name, "node%d", &node) == 1)
+            break;
+    closedir(d);
+    return node;
+}
+
+int affinity_mempolicy(const char *spec) {
+    unsigned long mask = 0;
+    int mode;
+
+    if (!strcmp(spec, "local")) {
+        mode = MPOL_DEFAULT;
+    } else if (!strcmp(spec, "interleave")) {
+        mode = MPOL_INTERLEAVE;
+        // Nodes without memory are skipped by the kernel
+        for (int n = 0; n < MAX_NODES; n++) {
+            char path[64];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", n);
+            if (access(path, F_OK) == 0)
+                mask |= 1ul << n;
+        }
+    } else {
+        char *end;
+        long node = strtol(spec, &end, 10);
+        if (*spec == '\0' || *end || node < 0 || node >= MAX_NODES)
+            return -1;
+        mode = MPOL_PREFERRED;
+        mask = 1ul << node;
+    }
+    return syscall(SYS_set_mempolicy, mode, mode == MPOL_DEFAULT ? NULL : &mask,
+            MAX_NODES + 1) ? -1 : 0;
+}
+
+void affinity_describe(const struct affinity *a, int nthreads, char *buf, size_t len) {
+    static const char *names[] = { "none", "list", "compact", "scatter" };
+    unsigned long nodes = 0;
+    size_t off;
+
+    if (a->policy == AFFINITY_NONE) {
+        snprintf(buf, len, "unpinned");
+        return;
+    }
+    off = snprintf(buf, len, "%s: cpus", names[a->policy]);
+    for (int i = 0; i < nthreads && off < len; i++) {
+        int cpu = affinity_cpu(a, i);
+        nodes |= 1ul << (affinity_node(cpu) % MAX_NODES);
+        off += snprintf(buf + off, len - off, "%s%d", i ? "," : " ", cpu);
+    }
+    for (int n = 0, first = 1; n < MAX_NODES && off < len; n++) {
+        if (!(nodes & (1ul << n)))
+            continue;
+        off += snprintf(buf + off, len - off, "%s%d", first ? " (nodes " : ",", n);
+        first = 0;
+    }
+    if (off < len)
+        snprintf(buf + off, len - off, ")");
+}
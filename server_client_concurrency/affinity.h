@@ -0,0 +1,57 @@
+#pragma once
+#include <stddef.h>
+
+/* Most CPUs a placement can spread threads over */
+#define AFFINITY_MAX_CPUS 1024
+
+enum AFFINITY_POLICY {
+    AFFINITY_NONE = 0,  /* leave threads to the scheduler */
+    AFFINITY_LIST,      /* the CPUs given, in the order given */
+    AFFINITY_COMPACT,   /* fill the hyperthreads and cores of one socket before the next */
+    AFFINITY_SCATTER    /* one thread per core, round robin over the sockets, then the hyperthreads */
+};
+
+/*
+ * Where each thread of a binary runs - thread i goes to cpus[i % num_cpus]
+ * Only CPUs the process was allowed to run on when the placement was parsed
+ * are used, so it composes with taskset and cgroups
+ */
+struct affinity {
+    enum AFFINITY_POLICY policy;
+    int num_cpus;
+    int cpus[AFFINITY_MAX_CPUS];
+    /* The process's CPUs before anything was pinned */
+    int num_allowed;
+    int allowed[AFFINITY_MAX_CPUS];
+};
+
+/*
+ * Parse "compact", "scatter" or a CPU list such as "0-3,8,10"
+ * @return 0 on success, -1 if spec is not valid or names no allowed CPU
+ */
+int affinity_parse(struct affinity *a, const char *spec);
+
+/* @return the CPU thread i runs on, -1 without a placement */
+int affinity_cpu(const struct affinity *a, int i);
+
+/* Pin the calling thread where thread i belongs - a no-op without a placement
+ * @return 0 on success, -1 otherwise */
+int affinity_pin(const struct affinity *a, int i);
+
+/* Let the calling thread run anywhere it could before the placement again */
+void affinity_unpin(const struct affinity *a);
+
+/* @return the NUMA node of cpu, 0 if the system does not say */
+int affinity_node(int cpu);
+
+/*
+ * Set the memory policy of the calling thread (and of threads it creates
+ * from now on): "local" allocates pages on the node that first touches
+ * them, "interleave" spreads them over every node, and a number prefers
+ * that node
+ * @return 0 on success, -1 if spec is not valid or the kernel refused it
+ */
+int affinity_mempolicy(const char *spec);
+
+/* Describe where the first nthreads threads run, e.g. "compact: cpus 0,1 (nodes 0)" */
+void affinity_describe(const struct affinity *a, int nthreads, char *buf, size_t len);
@@ -0,0 +1,119 @@
+#include "arena.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ARENA_MAGIC 0x414e455241766b73ull    /* "skvARENA" */
+// 2: slots are picked from the top bits of the hash
+#define ARENA_VERSION 2
+// Blocks start on a cache line, and the file grows by at least this much
+#define ARENA_ALIGN 64
+#define ARENA_GROW (1ull << 20)
+
+static uint64_t align_up(uint64_t n, uint64_t a) {
+    return (n + a - 1) & ~(a - 1);
+}
+
+// The header only counts once it is on disk - otherwise a crash could leave
+// a stale clean flag behind
+static int sync_header(struct arena *a) {
+    return msync(a->base, sizeof(struct arena_header), MS_SYNC);
+}
+
+static int set_size(struct arena *a, uint64_t size) {
+    if (ftruncate(a->fd, size))
+        return -1;
+    a->size = size;
+    return 0;
+}
+
+int arena_reset(struct arena *a) {
+    // Truncating first zeroes whatever was there
+    if (set_size(a, 0) || set_size(a, ARENA_GROW))
+        return -1;
+    a->hdr->magic = ARENA_MAGIC;
+    a->hdr->version = ARENA_VERSION;
+    a->hdr->clean = 0;
+    a->hdr->used = align_up(sizeof(struct arena_header), ARENA_ALIGN);
+    return sync_header(a);
+}
+
+int arena_open(struct arena *a, const char *path) {
+    struct stat st;
+    int usable;
+
+    if ((a->fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) < 0)
+        return -1;
+    if (fstat(a->fd, &st))
+        goto fail;
+    a->size = st.st_size;
+    a->base = mmap(NULL, ARENA_MAX_SIZE, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_NORESERVE, a->fd, 0);
+    if (a->base == MAP_FAILED)
+        goto fail;
+    a->hdr = (struct arena_header *)a->base;
+    pthread_mutex_init(&a->lock, NULL);
+
+    usable = a->size >= sizeof(struct arena_header) &&
+        a->hdr->magic == ARENA_MAGIC && a->hdr->version == ARENA_VERSION &&
+        a->hdr->clean && a->hdr->used <= a->size;
+    if (!usable)
+        return arena_reset(a) ? -1 : 0;
+    // From here on a crash leaves the file dirty
+    a->hdr->clean = 0;
+    return sync_header(a) ? -1 : 1;
+
+fail:
+    close(a->fd);
+    return -1;
+}
+
+uint64_t arena_alloc(struct arena *a, int cls, uint64_t bytes) {
+    uint64_t off;
+
+    bytes = align_up(bytes, ARENA_ALIGN);
+    pthread_mutex_lock(&a->lock);
+    if (cls != ARENA_PERMANENT && (off = a->hdr->free[cls])) {
+        a->hdr->free[cls] = *(uint64_t *)(a->base + off);
+        pthread_mutex_unlock(&a->lock);
+        memset(a->base + off, 0, bytes);
+        return off;
+    }
+    off = a->hdr->used;
+    if (off + bytes > a->size) {
+        uint64_t size = align_up(off + bytes, ARENA_GROW);
+        if (size < a->size * 2)
+            size = a->size * 2;
+        if (size > ARENA_MAX_SIZE)
+            size = ARENA_MAX_SIZE;
+        if (off + bytes > size || set_size(a, size)) {
+            pthread_mutex_unlock(&a->lock);
+            errno = ENOMEM;
+            return 0;
+        }
+    }
+    a->hdr->used = off + bytes;
+    pthread_mutex_unlock(&a->lock);
+    // Fresh file space reads as zeroes already
+    return off;
+}
+
+// The link to the next free block goes in the first word of the block
+void arena_free(struct arena *a, uint64_t off, int cls) {
+    if (off == 0 || cls == ARENA_PERMANENT)
+        return;
+    pthread_mutex_lock(&a->lock);
+    *(uint64_t *)(a->base + off) = a->hdr->free[cls];
+    a->hdr->free[cls] = off;
+    pthread_mutex_unlock(&a->lock);
+}
+
+int arena_close(struct arena *a) {
+    if (msync(a->base, a->size, MS_SYNC))
+        return -1;
+    a->hdr->clean = 1;
+    return sync_header(a);
+}
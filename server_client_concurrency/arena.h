@@ -0,0 +1,59 @@
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+
+/* Address space reserved for an arena - the file grows into it, so the
+ * mapping never moves and pointers into it stay valid while it is open */
+#define ARENA_MAX_SIZE (1ull << 36)
+/* Size classes with a free list of their own */
+#define ARENA_CLASSES 32
+/* Class of blocks that are never freed */
+#define ARENA_PERMANENT -1
+
+/*
+ * Start of an arena file. Everything in the file refers to other parts of it
+ * by offset from the start, so it can be mapped at any address.
+ */
+struct arena_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t clean;     /* set by arena_close, cleared by arena_open */
+    uint64_t used;      /* bytes handed out - bump allocation continues here */
+    uint64_t root;      /* offset of the user's root object, 0 if there is none */
+    uint64_t free[ARENA_CLASSES];   /* first free block of each class, 0 if none */
+};
+
+/* A file-backed allocator - blocks of one class must all have the same size */
+struct arena {
+    int fd;
+    char *base;
+    uint64_t size;      /* current file size */
+    struct arena_header *hdr;
+    pthread_mutex_t lock;
+};
+
+/*
+ * Map path, creating it if needed, and mark it in use
+ * @return 1 if the file was closed cleanly and its contents can be used,
+ * 0 if it had to be reset to an empty arena, -1 with errno set on failure
+ */
+int arena_open(struct arena *a, const char *path);
+
+/* Throw away everything in the arena */
+int arena_reset(struct arena *a);
+
+/* @return the offset of a zeroed block, 0 if the file cannot grow - thread-safe */
+uint64_t arena_alloc(struct arena *a, int cls, uint64_t bytes);
+void arena_free(struct arena *a, uint64_t off, int cls);
+
+/* Write everything back and mark the file clean - no allocations afterwards,
+ * the mapping stays valid */
+int arena_close(struct arena *a);
+
+static inline void *arena_ptr(struct arena *a, uint64_t off) {
+    return off ? a->base + off : NULL;
+}
+
+static inline uint64_t arena_off(struct arena *a, const void *p) {
+    return p ? (uint64_t)((const char *)p - a->base) : 0;
+}
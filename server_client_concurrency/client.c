@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/mman.h>
 #include <pthread.h>
@@ -6,27 +7,55 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <signal.h>
 #include <string.h>
+#include <inttypes.h>
+#include <limits.h>
 
 #include "common.h"
 #include "ring_buffer.h"
+#include "slab.h"
+#include "affinity.h"
+#include "stats.h"
+#include "workload.h"
 
 #define MAX_THREADS 128
 #define LINE_LEN 256
 
-#define PUT_STR "put"
-#define GET_STR "get"
-#define DEL_STR "del"
-
 #define READY 1
 #define NOT_READY 0
 
-struct request {
-	key_type k;
-	value_type v;
-	enum REQUEST_TYPE t;
+/* A sweep stops once the server delivers less than this share of the
+ * offered rate, or after this many rates */
+#define SWEEP_SATURATED 0.95
+#define MAX_SWEEP_STEPS 100
+
+/* Byte offsets of the doorbells, the per-thread submission queues (only
+ * present with -p), the completion boards, the MGET/MPUT vectors (only
+ * present with -g), the server's stats and the value area (only present
+ * with -z) in the shared region */
+#define DOORBELLS_OFF (ring_bytes(ring_capacity))
+#define SQS_OFF (DOORBELLS_OFF + num_threads * sizeof(struct completion_doorbell))
+#define COMPS_OFF (SQS_OFF + (per_thread_sq ? num_threads * sq_ring_bytes(ring_capacity) : 0))
+#define VECS_OFF (COMPS_OFF + num_threads * win_size * sizeof(struct buffer_descriptor))
+#define VECS_SIZE (group_size > 1 ? num_threads * win_size * group_size * sizeof(struct kv_pair) : 0)
+#define STATS_OFF ((VECS_OFF + VECS_SIZE + 63) & ~(size_t)63)
+#define SLAB_OFF ((STATS_OFF + sizeof(struct stats_region) + 63) & ~(size_t)63)
+#define SLAB_SIZE (value_bytes ? (size_t)slab_mb << 20 : 0)
+
+/* What one ring descriptor carries - a single request, or with -g a run of
+ * consecutive GETs or PUTs sent as one MGET/MPUT */
+struct vec_req {
+	int first; /* index of the first request in the thread's reqs */
+	int len;
+};
+
+/* A raw latency sample, for -o */
+struct lat_sample {
+	uint64_t sent_ns;
+	uint64_t lat_ns;
 };
 
 struct thread_context {
@@ -35,17 +64,29 @@ struct thread_context {
 	struct request *reqs; /* requests assigned to this thread */
 	struct buffer_descriptor *res; /* Corresponding result for each request in reqs */
 	struct buffer_descriptor *comps; /* Pointer to the start of the status board for this thread */
+	struct completion_doorbell *db; /* Doorbell the server pokes when it completes our requests */
 	int win_size;
 	int nxt_comp; /* next completion that we're expecting */
 	int comp_off; /* byte offset of the status board for this thread, w.r.t the start of the shared memory area */
+	int db_off; /* byte offset of the doorbell for this thread */
+	struct buffer_descriptor *subs; /* Staging area for one window of submissions */
+	struct vec_req *vecs; /* reqs grouped into descriptors - the window counts these */
+	int num_vecs;
+	struct kv_pair *vec_area; /* group_size pairs per window slot (only with -g) */
+	int vec_off; /* byte offset of vec_area */
+	struct lat_hist lat[STATS_NUM_OPS]; /* send to completion of each descriptor */
+	struct lat_sample *samples; /* one per descriptor (only with -o) */
+	uint64_t sched_start; /* with -R, when descriptor 0 is due */
 };
 
 struct ring *ring = NULL;
+struct slab *slab = NULL;
 char *shmem_area = NULL;
 char shm_file[] = "shmem_file";
 char workload_file[256];
 char expected_file[256];
 char server_exec[256];
+char *samples_file = NULL; /* -o: dump every latency sample here */
 pthread_t threads[MAX_THREADS];
 struct thread_context contexts[MAX_THREADS];
 struct request *requests;
@@ -57,10 +98,21 @@ int verbose = 0;
 int child_pid = -1;
 int do_fork = 0;
 int validate = 0;
+int per_thread_sq = 0;
+int group_size = 1; /* max requests per MGET/MPUT */
+uint32_t value_bytes = 0; /* with -z, values are blobs of up to this many bytes */
+uint32_t slab_mb = 64; /* size of the value area */
+struct affinity placement; /* -C: where the client threads run */
+char *mem_policy = NULL; /* -N: where the shared region's pages go */
+uint32_t ring_capacity = RING_SIZE;
+double rate = 0; /* -R: requests per second over all threads, 0 for closed loop */
+double rate_step = 0; /* -S: sweep the rate up in these steps */
+enum RING_WAIT_MODE wait_mode = RING_WAIT_HYBRID;
 
 /* Server arguments */
 int s_num_threads = 1;
 int s_init_table_size = 1000;
+char s_extra_args[256]; /* passed through to the server, split on spaces */
 
 /* prints "Client" before each line of output because the child will also be printing
  * to the same terminal */
@@ -73,8 +125,9 @@ void fork_server() {
 	pid_t pid = fork();
 	
 	if (pid == 0) { /* The child process */
-		/* number of arguments including the NULL pointer at the end */
-		const int NUM_ARGS = 7;
+		/* number of arguments including the NULL pointer at the end,
+		 * plus room for whatever -a passes through */
+		const int NUM_ARGS = 7 + strlen(s_extra_args) / 2 + 1;
 		const int MAX_ARG_LEN = 256;
 		char **argv = malloc(NUM_ARGS * sizeof(char *));
 		if (argv == NULL)
@@ -94,6 +147,8 @@ void fork_server() {
 		sprintf(argv[idx++], "%d", s_num_threads);
 		if (verbose)
 			sprintf(argv[idx++], "-v");
+		for (char *tok = strtok(s_extra_args, " "); tok != NULL; tok = strtok(NULL, " "))
+			strcpy(argv[idx++], tok);
 		argv[idx++] = NULL;
 		execvp(server_exec, argv);
 
@@ -112,18 +167,20 @@ void fork_server() {
  * Sets the shmem_area global variable to the beginning of the shared region
  * Sets the ring global variable the beginning of the shared region 
  * Shared memory area is organized as follows:
- * | RING | TID_0_COMPLETIONS | TID_1_COMPLETIONS | ... | TID_N_COMPLETIONS |
+ * | RING | TID_0_DOORBELL | ... | TID_N_DOORBELL | [TID_0_SQ | ... | TID_N_SQ] | TID_0_COMPLETIONS | TID_1_COMPLETIONS | ... | TID_N_COMPLETIONS | [TID_0_VECTORS | ... | TID_N_VECTORS] | STATS | [VALUES] |
+ * The per-thread submission queues are only there when -p is set, the vectors only when -g is,
+ * the value area only when -z is
 */
 int init_client() {
-	int shm_size = sizeof(struct ring) + 
-		num_threads * win_size * sizeof(struct buffer_descriptor);
+	size_t shm_size = SLAB_OFF + SLAB_SIZE;
 	
 	int fd = open(shm_file, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
 	if (fd < 0)
 		perror("open");
 
-	/* Make the file length exactly shm_size bytes */
-	if (ftruncate(fd, shm_size) == -1)
+	/* Make the file length exactly shm_size bytes - emptying it first
+	 * drops the pages of the last run, which may sit on another node */
+	if (ftruncate(fd, 0) == -1 || ftruncate(fd, shm_size) == -1)
 		perror("ftruncate");
 
 	char *mem = mmap(NULL, shm_size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
@@ -133,90 +190,68 @@ int init_client() {
 	/* mmap dups the fd, no longer needed */
 	close(fd);
 
+	/* Touch every page, the value area too - under the memory policy, from
+	 * thread 0's CPU, rather than wherever it happens to be written first */
 	memset(mem, 0, shm_size);
 	ring = (struct ring *)mem;
 	shmem_area = mem;
 	int ring_rc = -1;
-	if (ring_rc = init_ring(ring) < 0) {
+	if ((ring_rc = init_ring(ring, ring_capacity, wait_mode)) < 0) {
 		printf("Ring initialization failed with %d as return code\n", ring_rc);
 		exit(EXIT_FAILURE);
 	}
+	if (per_thread_sq && (ring_rc = init_sq_rings(ring, num_threads, SQS_OFF)) < 0) {
+		printf("Submission queue initialization failed with %d as return code\n", ring_rc);
+		exit(EXIT_FAILURE);
+	}
+	/* The server fills it in, kvstat reads it */
+	ring->stats_off = STATS_OFF;
+	if (value_bytes) {
+		slab = (struct slab *)(mem + SLAB_OFF);
+		if (slab_init(slab, SLAB_SIZE) < 0) {
+			printf("Value area of %u MB does not fit\n", slab_mb);
+			exit(EXIT_FAILURE);
+		}
+		/* Tells the kv_store its values are handles of blocks in there */
+		ring->slab_off = SLAB_OFF;
+	}
+
+	/* The shared region is in place - the server picks its own placement */
+	affinity_unpin(&placement);
+	if (mem_policy)
+		affinity_mempolicy("local");
 
 	if (do_fork)
 		fork_server();
 }
 
-/*
- * Get request type from req_str and set type
- * @return 0 on success, -1 on failure
- * On failure, contents of type are undefined 
-*/
-int get_req_type(char *req_str, enum REQUEST_TYPE *type) {
-	int rc = 0;
-	if (!strcmp(req_str, PUT_STR))
-		*type = PUT;
-	else if (!strcmp(req_str, GET_STR))
-		*type = GET;
-	else
-		rc = -1;
-
-	return rc;
-}
-
-/* 
- * Parses an input line and stores the result into requests at index
- * @return 0 on success, -1 on failure
-*/
-int add_line_to_req(char *line, int index) {
-	char *copy_line = strdup(line);
-	char *tok = strtok(copy_line, " ");
-	if (tok == NULL)
-		return -1;
-
-	enum REQUEST_TYPE type;
-	if (get_req_type(tok, &type) < 0)
-		return -1;
-
-	requests[index].t = type;
-
-	tok = strtok(NULL, " ");
-	if (tok == NULL)
-		return -1;
-
-	int key = atoi(tok);
-	requests[index].k = key;
-
-	int value;
-	if (type == PUT) {
-		tok = strtok(NULL, " ");
-		if (tok == NULL)
-			return -1;
-
-		value = atoi(tok);
-		requests[index].v = value;
-	}
-	return 0;
-}
-
 int count_lines(FILE *f) {
 	char line[LINE_LEN];
 	int nl = 0;
-	while(!feof(f)) {
-		fgets(line, LINE_LEN, f);
-		/* This prevents the last line from being read twice */
-		if (feof(f))
-			break;
+	/* A last line without a newline counts too */
+	while (fgets(line, LINE_LEN, f) != NULL)
 		nl++;
-	}
 	fseek(f, 0, SEEK_SET);
 	return nl;
 }
 
 /*
  * Reads the workload_file and stores in the requests array (global var)
- * Allocates both requests/results array enough space for all requests
+ * A binary workload (see workload.h) is mapped and used in place - a text
+ * one is parsed into a new array
+ * Allocates the results array enough space for all requests
 */
 void read_input_files() {
+	uint64_t count;
+	if ((requests = wl_map(workload_file, WL_REQUESTS, &count)) != NULL) {
+		PRINTV("Mapped %" PRIu64 " binary requests\n", count);
+		num_requests = count;
+		results = malloc(num_requests * sizeof(struct buffer_descriptor));
+		if (results == NULL)
+			perror("malloc");
+		return;
+	}
+
 	FILE *f = fopen(workload_file, "r");
 	if (f == NULL)
 		perror("fopen");
@@ -235,52 +270,173 @@ void read_input_files() {
 		perror("malloc");
 
 	/* Read line by line and fill up the requests array
-	 * Ignores invalid lines */
+	 * Ignores invalid lines, so there may be fewer requests than lines */
 	char line[LINE_LEN];
 	int index = 0;
-	while (!feof(f)) {
-		fgets(line, LINE_LEN, f);
-		if (add_line_to_req(line, index) < 0)
+	while (index < nl && fgets(line, LINE_LEN, f) != NULL) {
+		if (wl_parse_line(line, &requests[index]) < 0)
 			continue;
 		
 		index++;
 	}
+	num_requests = index;
+	fclose(f);
+}
+
+/*
+ * With -z, value v travels as a blob of blob_len(v) bytes: v itself followed
+ * by bytes that depend on v, so a GET can check every byte it reads
+*/
+uint32_t blob_len(value_type v) {
+	uint32_t min = value_bytes / 2 > sizeof(value_type) ? value_bytes / 2 : sizeof(value_type);
+	return min + hash_murmur3(v) % (value_bytes - min + 1);
+}
+
+/*
+ * Write the blob for v into a new block of the value area
+ * The kv_store takes the block over with the PUT
+ * @return the block's handle, its length in *len
+*/
+uint32_t blob_put(value_type v, uint32_t *len) {
+	uint32_t n = blob_len(v);
+	uint32_t h = slab_alloc(slab, n);
+	if (h == 0) {
+		printf("Value area is full - make it larger with -Z\n");
+		exit(EXIT_FAILURE);
+	}
+	char *data = slab_block(slab, h)->data;
+	memcpy(data, &v, sizeof(value_type));
+	for (uint32_t i = sizeof(value_type); i < n; i++)
+		data[i] = (char)(v + i);
+	*len = n;
+	return h;
 }
 
 /*
- * Submits as many requests as win_size allows 
+ * Read the value of a GET result straight out of its block and drop the
+ * reference the kv_store took for us
+ * @return the value, 0 if there was no block
+*/
+value_type blob_get(uint32_t h) {
+	if (h == 0)
+		return 0;
+	struct slab_block *b = slab_block(slab, h);
+	value_type v;
+	memcpy(&v, b->data, sizeof(value_type));
+	int ok = b->len == blob_len(v);
+	for (uint32_t i = sizeof(value_type); ok && i < b->len; i++)
+		ok = b->data[i] == (char)(v + i);
+	slab_put(slab, h);
+	if (!ok) {
+		fprintf(stderr, "Block %u does not hold a valid value\n", h);
+		exit(EXIT_FAILURE);
+	}
+	return v;
+}
+
+/*
+ * Groups the requests of a thread into descriptors - with -g, runs of up to
+ * group_size consecutive GETs (or PUTs) share one; anything else goes alone
+*/
+void build_vecs(struct thread_context *ctx) {
+	struct request *reqs = ctx->reqs;
+	int n = 0;
+
+	ctx->vecs = malloc(ctx->num_reqs * sizeof(struct vec_req));
+	if (ctx->vecs == NULL)
+		perror("malloc");
+
+	for (int i = 0; i < ctx->num_reqs; i += ctx->vecs[n++].len) {
+		struct vec_req *vr = &ctx->vecs[n];
+		vr->first = i;
+		vr->len = 1;
+		if (reqs[i].t != GET && reqs[i].t != PUT)
+			continue;
+		while (vr->len < group_size && i + vr->len < ctx->num_reqs &&
+				reqs[i + vr->len].t == reqs[i].t)
+			vr->len++;
+	}
+	ctx->num_vecs = n;
+}
+
+/*
+ * With -R, when descriptor i is due - the slot of its first request in a
+ * schedule of rate / num_threads requests per second for each thread
+*/
+uint64_t due_ns(struct thread_context *ctx, int i) {
+	return ctx->sched_start + (uint64_t)(ctx->vecs[i].first * (num_threads * 1e9 / rate));
+}
+
+/*
+ * Submits as many descriptors as win_size allows - with -R, only those
+ * that are due
+ * The whole window is handed to the ring in one ring_submit_batch call
  * last_submitted is updated in this function
  * @param ctx Context for this thread
- * @param last_completed last request that was completed
- * @param last_submitted last request that was submitted
+ * @param last_completed last descriptor that was completed
+ * @param last_submitted last descriptor that was submitted
 */
 void submit_reqs(struct thread_context *ctx, int *last_completed, int *last_submitted) {
-	struct buffer_descriptor bd;
-	struct request *reqs = ctx->reqs;
-	/* Keep win_size number of in-flight requests */
-	for (int i = *last_submitted; *last_submitted - *last_completed < win_size; i++) {
+	int n = 0;
+	uint64_t now = stats_now();
+	/* Keep win_size number of in-flight descriptors */
+	for (int i = *last_submitted; i - *last_completed < win_size; i++) {
 		/* Have we submitted all of the requests? */
-		if (*last_submitted >= ctx->num_reqs)
+		if (i >= ctx->num_vecs)
+			break;
+		if (rate && due_ns(ctx, i) > now)
 			break;
 
-		memset(&bd, 0, sizeof(struct buffer_descriptor));
-		bd.k = reqs[i].k;
-		bd.v = reqs[i].v;
-		bd.req_type = reqs[i].t;
-		bd.res_off = ctx->comp_off + (*last_submitted % win_size) * sizeof(struct buffer_descriptor);
-		ring_submit(ring, &bd);
-		(*last_submitted)++;
+		struct vec_req *vr = &ctx->vecs[i];
+		struct request *req = &ctx->reqs[vr->first];
+		struct buffer_descriptor *bd = &ctx->subs[n++];
+		memset(bd, 0, sizeof(struct buffer_descriptor));
+		bd->k = req->k;
+		bd->v = req->v;
+		bd->req_type = req->t;
+		if (value_bytes && req->t == PUT && vr->len == 1)
+			bd->v = blob_put(req->v, &bd->val_len);
+		bd->res_off = ctx->comp_off + (i % win_size) * sizeof(struct buffer_descriptor);
+		bd->db_off = ctx->db_off;
+		/* Open loop latency counts from when the request should have gone out */
+		bd->sent_ns = rate ? due_ns(ctx, i) : now;
+		if (vr->len > 1) {
+			/* The window slot owns group_size pairs - free again once
+			 * the slot's completion has been processed */
+			int slot = (i % win_size) * group_size;
+			struct kv_pair *vec = ctx->vec_area + slot;
+			uint32_t len;
+			for (int j = 0; j < vr->len; j++) {
+				vec[j].k = req[j].k;
+				vec[j].v = req[j].v;
+				/* Blocks carry their own length */
+				if (value_bytes && req->t == PUT)
+					vec[j].v = blob_put(req[j].v, &len);
+			}
+			bd->req_type = req->t == GET ? MGET : MPUT;
+			bd->vec_off = ctx->vec_off + slot * sizeof(struct kv_pair);
+			bd->vec_len = vr->len;
+		}
 
-		PRINTV("New submission %u %u\n", bd.k, bd.v);
+		PRINTV("New submission %u %u\n", bd->k, bd->v);
 	}
+
+	if (n == 0)
+		return;
+
+	if (per_thread_sq)
+		sq_submit_batch(ring, ctx->tid, ctx->subs, n);
+	else
+		ring_submit_batch(ring, ctx->subs, n);
+	*last_submitted += n;
 }
 
 /*
  * Check possible completions in the request status board
  * Updates last_completed if there are any new completions
  * @param ctx context for this thread
- * @param last_completed last request that was completed
- * @param last_submitted last request that was submitted
+ * @param last_completed last descriptor that was completed
+ * @param last_submitted last descriptor that was submitted
 */
 void process_completions(struct thread_context *ctx, int *last_completed, int *last_submitted) {
 	/* Check completions until we break */
@@ -290,11 +446,40 @@ void process_completions(struct thread_context *ctx, int *last_completed, int *l
 		 * check the next one.
 		 * Notice that we're only allowing 'in-order acknowledgements'. */
 		if (ctx->comps[ctx->nxt_comp].ready == READY) {
+			/* Read the clock as each completion is seen - the later ones
+			 * may land while the loop runs, after a read at its top */
+			uint64_t now = stats_now();
 			struct buffer_descriptor tmp = ctx->comps[ctx->nxt_comp];
 			PRINTV("New completion: %u %u\n", tmp.k, tmp.v);
 			ctx->comps[ctx->nxt_comp].ready = NOT_READY;
-			memcpy(&ctx->res[*last_completed], &ctx->comps[ctx->nxt_comp],
-				       	sizeof(struct buffer_descriptor));
+			struct vec_req *vr = &ctx->vecs[*last_completed];
+			/* The server hands back our send time with the result */
+			uint64_t lat = now - tmp.sent_ns;
+			hist_add(&ctx->lat[tmp.req_type == GET || tmp.req_type == MGET ? STATS_GET : STATS_PUT], lat);
+			if (ctx->samples) {
+				ctx->samples[*last_completed].sent_ns = tmp.sent_ns;
+				ctx->samples[*last_completed].lat_ns = lat;
+			}
+			if (tmp.req_type == MGET || tmp.req_type == MPUT) {
+				/* Unpack the vector into per-request results */
+				struct kv_pair *vec = ctx->vec_area + ctx->nxt_comp * group_size;
+				for (int j = 0; j < vr->len; j++) {
+					struct buffer_descriptor *res = &ctx->res[vr->first + j];
+					memcpy(res, &tmp, sizeof(struct buffer_descriptor));
+					res->req_type = ctx->reqs[vr->first + j].t;
+					res->k = vec[j].k;
+					res->v = vec[j].v;
+					if (value_bytes)
+						res->v = tmp.req_type == MGET ? blob_get(vec[j].v) : ctx->reqs[vr->first + j].v;
+				}
+			} else {
+				memcpy(&ctx->res[vr->first], &tmp, sizeof(struct buffer_descriptor));
+				/* The result holds a handle - put the value in its place */
+				if (value_bytes && tmp.req_type == GET)
+					ctx->res[vr->first].v = blob_get(tmp.v);
+				else if (value_bytes && tmp.req_type == PUT)
+					ctx->res[vr->first].v = ctx->reqs[vr->first].v;
+			}
 
 			/* Update for the next iteration */
 			(*last_completed)++;
@@ -306,6 +491,33 @@ void process_completions(struct thread_context *ctx, int *last_completed, int *l
 	}
 }
 
+/*
+ * Open loop (-R): each descriptor goes out when it is due, whether or not
+ * the ones before it have completed, so a slow server cannot slow the load
+ * down and hide its own queueing delay
+ * Only a full window holds a send back, and then the wait shows up in the
+ * latency, as that counts from the due time
+ * @param ctx context for this thread
+*/
+void run_open_loop(struct thread_context *ctx) {
+	int last_completed = 0;
+	int last_submitted = 0;
+	/* Threads take turns in the schedule rather than all sending at once */
+	ctx->sched_start = stats_now() + (uint64_t)(ctx->tid * 1e9 / rate);
+	while (1) {
+		submit_reqs(ctx, &last_completed, &last_submitted);
+		process_completions(ctx, &last_completed, &last_submitted);
+		if (last_completed == ctx->num_vecs)
+			break;
+		/* Sleep until the next descriptor is due or the oldest completes -
+		 * with a full window, only the latter helps */
+		uint64_t deadline = 0;
+		if (last_submitted < ctx->num_vecs && last_submitted - last_completed < win_size)
+			deadline = due_ns(ctx, last_submitted);
+		ring_wait_completion_until(ring, &ctx->comps[ctx->nxt_comp], ctx->db, deadline);
+	}
+}
+
 /* 
  * Function that's run by each thread
  * @param arg context for this thread
@@ -315,21 +527,31 @@ void *thread_function(void *arg) {
 	int last_completed = 0;
 	int last_submitted = 0;
 	PRINTV("Num reqs is %d\n", ctx->num_reqs);
-	/* Keep submitting the requests and processing the completions */
-	for (; last_submitted < ctx->num_reqs; ) {
+	if (affinity_pin(&placement, ctx->tid))
+		perror("pthread_setaffinity_np");
+	if (rate) {
+		run_open_loop(ctx);
+		return NULL;
+	}
+	/* Keep submitting the requests and processing the completions
+	 * After a submission the window is full (or everything is in flight),
+	 * so sleep until the oldest request completes instead of polling */
+	for (; last_submitted < ctx->num_vecs; ) {
 		submit_reqs(ctx, &last_completed, &last_submitted);	
+		ring_wait_completion(ring, &ctx->comps[ctx->nxt_comp], ctx->db);
 		process_completions(ctx, &last_completed, &last_submitted);
 	}
 
 	PRINTV("Done with subs\n");
 	/* There might be some completions still in flight */
-	while (last_completed < ctx->num_reqs)
+	while (last_completed < ctx->num_vecs) {
+		ring_wait_completion(ring, &ctx->comps[ctx->nxt_comp], ctx->db);
 		process_completions(ctx, &last_completed, &last_submitted);
+	}
 }
 
 /*
- * Launch num_threads number of threads
- * Prepares the context for each thread
+ * Prepare the context for each thread
  * The way we assign work to each thread is as follows:
  *
  * 	|  T0  |  T1  |  ...  |  TN  |
@@ -337,7 +559,7 @@ void *thread_function(void *arg) {
  *  
  *  Each thread submits an equal contiguous part of the requests
 */
-void start_threads() {
+void init_contexts() {
 	int reqs_per_th = num_requests / num_threads;
 	struct request *r = requests;
 	struct buffer_descriptor *rs = results;
@@ -347,13 +569,25 @@ void start_threads() {
 		contexts[i].num_reqs = reqs_per_th;
 		contexts[i].reqs = r;
 		contexts[i].win_size = win_size;
-		contexts[i].comps = (struct buffer_descriptor *) (shmem_area + sizeof(struct ring) + i * win_size * sizeof(struct buffer_descriptor));
+		contexts[i].comps = (struct buffer_descriptor *) (shmem_area + COMPS_OFF + i * win_size * sizeof(struct buffer_descriptor));
+		contexts[i].db_off = DOORBELLS_OFF + i * sizeof(struct completion_doorbell);
+		contexts[i].db = (struct completion_doorbell *) (shmem_area + contexts[i].db_off);
 		contexts[i].res = rs;
+		contexts[i].subs = malloc(win_size * sizeof(struct buffer_descriptor));
+		if (contexts[i].subs == NULL)
+			perror("malloc");
+		contexts[i].vec_off = VECS_OFF + i * win_size * group_size * sizeof(struct kv_pair);
+		contexts[i].vec_area = (struct kv_pair *) (shmem_area + contexts[i].vec_off);
+		build_vecs(&contexts[i]);
+		if (samples_file) {
+			contexts[i].samples = malloc(contexts[i].num_vecs * sizeof(struct lat_sample));
+			if (contexts[i].samples == NULL) {
+				perror("malloc");
+				exit(EXIT_FAILURE);
+			}
+		}
 		/* This is the byte offset to the first window for this thread */
-		contexts[i].comp_off = sizeof(struct ring) + contexts[i].tid * win_size * sizeof(struct buffer_descriptor);
-
-		if (pthread_create(&threads[i], NULL, &thread_function, &contexts[i]))
-			perror("pthread_create");
+		contexts[i].comp_off = COMPS_OFF + contexts[i].tid * win_size * sizeof(struct buffer_descriptor);
 
 		/* Each thread is only responsible for an equal part of requests */
 		r += reqs_per_th;
@@ -361,6 +595,15 @@ void start_threads() {
 	}
 }
 
+/*
+ * Launch num_threads number of threads, each on its own context
+*/
+void start_threads() {
+	for (int i = 0; i < num_threads; i++)
+		if (pthread_create(&threads[i], NULL, &thread_function, &contexts[i]))
+			perror("pthread_create");
+}
+
 void wait_for_threads() {
 	for (int i = 0; i < num_threads; i++)
 		if (pthread_join(threads[i], NULL))
@@ -368,7 +611,7 @@ void wait_for_threads() {
 }
 
 void usage(char *name) {
-	printf("Usage: %s [-h] [-n num_threads] [-w win_size] [-v] [-t kv_store_threads] [-s init_table_size] [-f]\n", name);
+	printf("Usage: %s [-h] [-n num_threads] [-w win_size] [-v] [-t kv_store_threads] [-s init_table_size] [-f] [-m wait_mode] [-p] [-q ring_capacity] [-g group_size] [-z value_bytes] [-Z area_mb] [-C cpus] [-N mem_policy] [-o samples_file] [-R rate] [-S rate_step] [-a server_args]\n", name);
 	printf("-h show this help\n");
 	printf("-n specify the number of threads\n");
 	printf("-w specify the window size (max distance between last submitted request and last completed request\n");
@@ -377,9 +620,21 @@ void usage(char *name) {
 	printf("-s initial_table_size in the kv_store program (ignored if -f is not set)\n");
 	printf("-f if set, forks the kv_store program as the child process - '-t' and '-s' options are only effective if this is set\n");
 	printf("-c if set, checks the result of get queries - only works if -n 1 and -w 1 (synchronus submission)\n");
-	printf("-l input workload file name (default: workload.txt)\n");
-	printf("-e file name that contains the expected results for get queries(default: solution.txt)\n");
+	printf("-i input workload file name, text or binary (see wlconvert) (default: workload.txt)\n");
+	printf("-e file name that contains the expected results for get queries, text or binary (default: solution.txt)\n");
 	printf("-x full path of the server executable file (default: ./server)\n");
+	printf("-a extra arguments for the kv_store program, e.g. -a \"-l 256 -r\" (ignored if -f is not set)\n");
+	printf("-q ring capacity, rounded up to a power of two (default: %d)\n", RING_SIZE);
+	printf("-p give each thread its own submission queue instead of sharing the ring (at most %d threads)\n", MAX_SQ);
+	printf("-m how ring waiters wait: spin, hybrid (spin then futex) or block (default: hybrid)\n");
+	printf("-g send up to group_size consecutive gets (puts) as one MGET (MPUT) descriptor, at most %d (default: 1)\n", MAX_VEC);
+	printf("-z send each value as a blob of value_bytes / 2 to value_bytes bytes in shared memory, at most %zu (default: plain numbers)\n", SLAB_MAX_VALUE);
+	printf("-Z size of the shared memory area that holds the blobs in MB (default: 64)\n");
+	printf("-C pin thread i to the i-th cpu of compact, scatter or a list like 0-3,8 (default: unpinned) - the server takes -C too, through -a\n");
+	printf("-N where the pages of the shared region go: local (to the thread that touches them first), interleave or a node number (default: local)\n");
+	printf("-o write every latency sample to this file, one \"thread op send_us latency_ns\" line per descriptor (default: none)\n");
+	printf("-R open loop: send requests on a fixed schedule of rate requests/s over all threads, latency counted from when each was due - give it a large -w (default: closed loop)\n");
+	printf("-S sweep: replay the workload at -R, then rate_step faster each time, until the server falls below %.0f%% of the offered rate - prints the latency at each rate and the knee\n", SWEEP_SATURATED * 100);
 }
 
 static int parse_args(int argc, char **argv)
@@ -390,7 +645,7 @@ static int parse_args(int argc, char **argv)
 	strcpy(server_exec, "./server");
 
 	int op;
-	while ((op = getopt(argc, argv, "hn:w:vt:s:fce:i:x:")) != -1) {
+	while ((op = getopt(argc, argv, "hn:w:vt:s:fce:i:x:m:pq:a:g:z:Z:C:N:o:R:S:")) != -1) {
 		switch (op) {
 		case 'h':
 		usage(argv[0]);
@@ -437,11 +692,117 @@ static int parse_args(int argc, char **argv)
 		strncpy(server_exec, optarg, 256);
 		break;
 
+		case 'p':
+		per_thread_sq = 1;
+		break;
+
+		case 'a':
+		strncpy(s_extra_args, optarg, sizeof(s_extra_args) - 1);
+		break;
+
+		case 'q': {
+		long cap = atol(optarg);
+		if (cap < 2 || cap > RING_MAX_SIZE) {
+			usage(argv[0]);
+			return 1;
+		}
+		/* Round up to a power of two so the ring can mask its indices */
+		ring_capacity = 1;
+		while (ring_capacity < cap)
+			ring_capacity <<= 1;
+		break;
+		}
+
+		case 'g':
+		group_size = atoi(optarg);
+		if (group_size < 1 || group_size > MAX_VEC) {
+			usage(argv[0]);
+			return 1;
+		}
+		break;
+
+		case 'z':
+		value_bytes = atoi(optarg);
+		if (value_bytes < sizeof(value_type) || value_bytes > SLAB_MAX_VALUE) {
+			usage(argv[0]);
+			return 1;
+		}
+		break;
+
+		case 'Z':
+		slab_mb = atoi(optarg);
+		if (slab_mb < 1 || slab_mb >= 4096) {
+			usage(argv[0]);
+			return 1;
+		}
+		break;
+
+		case 'C':
+		if (affinity_parse(&placement, optarg) < 0) {
+			usage(argv[0]);
+			return 1;
+		}
+		break;
+
+		case 'N':
+		mem_policy = optarg;
+		break;
+
+		case 'o':
+		samples_file = optarg;
+		break;
+
+		case 'R':
+		rate = atof(optarg);
+		if (rate <= 0) {
+			usage(argv[0]);
+			return 1;
+		}
+		break;
+
+		case 'S':
+		rate_step = atof(optarg);
+		if (rate_step <= 0) {
+			usage(argv[0]);
+			return 1;
+		}
+		break;
+
+		case 'm':
+		if (!strcmp(optarg, "spin"))
+			wait_mode = RING_WAIT_SPIN;
+		else if (!strcmp(optarg, "hybrid"))
+			wait_mode = RING_WAIT_HYBRID;
+		else if (!strcmp(optarg, "block"))
+			wait_mode = RING_WAIT_BLOCK;
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+		break;
+
 		default:
 		usage(argv[0]);
 		return 1;
 		}
 	}
+	/* A replayed workload's gets no longer match the solution */
+	if (rate_step && (!rate || validate)) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (num_threads < 1 || num_threads > MAX_THREADS || win_size < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	/* Descriptors carry their offsets as ints and the ring its own as 32
+	 * bits - everything up to the value area must lie below 2 GB */
+	if ((size_t)num_threads * win_size * group_size * sizeof(struct kv_pair) > INT_MAX ||
+			SLAB_OFF > INT_MAX) {
+		printf("%d threads with windows of %d and a ring of %u need more than 2 GB of shared memory\n",
+				num_threads, win_size, ring_capacity);
+		return 1;
+	}
 	return 0;
 }
 
@@ -453,6 +814,32 @@ double get_elapsed_ns(struct timespec *start, struct timespec *end) {
     return elapsed;
 }
 
+/*
+ * Write the raw samples of every thread to samples_file, send times in us
+ * since start
+ * @return 0 on success, -1 otherwise
+*/
+int write_samples(uint64_t start) {
+	FILE *f = fopen(samples_file, "w");
+	if (f == NULL) {
+		perror("fopen");
+		return -1;
+	}
+	for (int i = 0; i < num_threads; i++) {
+		struct thread_context *ctx = &contexts[i];
+		for (int j = 0; j < ctx->num_vecs; j++) {
+			enum REQUEST_TYPE t = ctx->reqs[ctx->vecs[j].first].t;
+			fprintf(f, "%d %s %.3f %" PRIu64 "\n", i, t == GET ? GET_STR : t == PUT ? PUT_STR : DEL_STR,
+					(ctx->samples[j].sent_ns - start) / 1e3, ctx->samples[j].lat_ns);
+		}
+	}
+	if (fclose(f)) {
+		perror("fclose");
+		return -1;
+	}
+	return 0;
+}
+
 /* 
  * Reads the solution file
  * Line n of this file is a number which specifies the result of the nth get request
@@ -462,34 +849,34 @@ double get_elapsed_ns(struct timespec *start, struct timespec *end) {
 void read_expected_file(FILE *f, value_type *exp) {
 	char line[LINE_LEN];
 	int idx = 0;
-	while (!feof(f)) {
-		fgets(line, LINE_LEN, f);
-		/* Prevent the last line from being read twice */
-		if (feof(f))
-			break;
-
-		exp[idx++] = atoi(line);
-	}
+	while (fgets(line, LINE_LEN, f) != NULL)
+		exp[idx++] = strtoul(line, NULL, 10);
 }
 
 /*
  * Check if the results returned by the server match the expected values
  * This function is only called if -c option is set
  * @param expected expected values (nth element is the result of nth get request)
+ * @param num_expected number of expected values
  * @return 0 on success, 1 otherwise
 */
-int check_results(value_type *expected) {
-	int exp_idx = 0;
+int check_results(value_type *expected, uint64_t num_expected) {
+	uint64_t exp_idx = 0;
 	for (int i = 0; i < num_requests; i++) {
 		/* Only interested in GET requests */
 		if (requests[i].t != GET)
 			continue;
 
+		if (exp_idx == num_expected) {
+			fprintf(stderr, "%s has fewer results than there are gets\n", expected_file);
+			return 1;
+		}
+
 		/* Mismatch! */
 		if (results[i].v != expected[exp_idx]) {
 			fprintf(stderr, "Get(%u) should return %u, but got %u\n", 
 					results[i].k, expected[exp_idx], results[i].v);
-			fprintf(stderr, "Indices: req=%d exp=%d\n", i, exp_idx);
+			fprintf(stderr, "Indices: req=%d exp=%" PRIu64 "\n", i, exp_idx);
 			return 1;
 		}
 		exp_idx++;
@@ -499,6 +886,14 @@ int check_results(value_type *expected) {
 	return 0;
 }
 
+/* Where the client ran and what the server was told - results depend on it */
+void print_placement() {
+	char where[256];
+	affinity_describe(&placement, num_threads, where, sizeof(where));
+	printf("Placement: client %s, shared memory policy %s, server args \"%s\"\n",
+			where, mem_policy ? mem_policy : "local", s_extra_args);
+}
+
 /*
  * Check the correctness of the results and print performance numbers
  * @param s start timestamp
@@ -507,19 +902,24 @@ int check_results(value_type *expected) {
 */
 int process_results(struct timespec *s, struct timespec *e) {
 	if (validate) {
-		value_type *expected = NULL;
-		FILE *f = fopen(expected_file, "r");
-		if (f == NULL)
-			perror("fopen");
-
-		int nl = count_lines(f);
-		expected = malloc(nl * sizeof(value_type));
-		if (expected == NULL)
-			perror("malloc");
+		uint64_t nl;
+		/* A binary solution is used in place, like a binary workload */
+		value_type *expected = wl_map(expected_file, WL_SOLUTION, &nl);
+		if (expected == NULL) {
+			FILE *f = fopen(expected_file, "r");
+			if (f == NULL)
+				perror("fopen");
+
+			nl = count_lines(f);
+			expected = malloc(nl * sizeof(value_type));
+			if (expected == NULL)
+				perror("malloc");
 
-		read_expected_file(f, expected);
+			read_expected_file(f, expected);
+			fclose(f);
+		}
 
-		if (check_results(expected) != 0)
+		if (check_results(expected, nl) != 0)
 			return 1;
 	}
 
@@ -527,30 +927,105 @@ int process_results(struct timespec *s, struct timespec *e) {
 	/* Throughput in K requests per second */
 	double tput = (num_requests * 1e6) / ns;
 	printf("Total time: %f ms\nThroughput: %f K/s\n", ns / 1e6, tput);
+	if (rate)
+		printf("Offered: %f K/s (open loop)\n", rate / 1e3);
+
+	print_placement();
+
+	/* Percentiles over every thread's descriptors - an MGET/MPUT is one sample */
+	struct lat_hist put = { 0 }, get = { 0 };
+	for (int i = 0; i < num_threads; i++) {
+		hist_merge(&put, &contexts[i].lat[STATS_PUT], 1);
+		hist_merge(&get, &contexts[i].lat[STATS_GET], 1);
+	}
+	hist_print(&put, "PUT/DEL latency", stdout);
+	hist_print(&get, "GET latency", stdout);
 
 	/* No errors in check results */
 	return 0;
 }
 
+/*
+ * -S: replay the workload open loop at -R, then rate_step faster each time,
+ * until the server no longer keeps up - the knee is the last rate it did
+ * Each pass runs against the same server, so later passes find the table full
+*/
+void sweep() {
+	double knee = 0;
+
+	/* sweep never gets to process_results, which prints this otherwise */
+	print_placement();
+	printf("%12s %12s %10s %10s %10s %10s\n", "offered/s", "achieved/s",
+			"p50 us", "p99 us", "p99.9 us", "max us");
+	for (int step = 0; step < MAX_SWEEP_STEPS; step++, rate += rate_step) {
+		uint64_t start = stats_now();
+		start_threads();
+		wait_for_threads();
+		double achieved = num_requests * 1e9 / (stats_now() - start);
+
+		struct lat_hist all = { 0 };
+		for (int i = 0; i < num_threads; i++) {
+			for (int op = 0; op < STATS_NUM_OPS; op++)
+				hist_merge(&all, &contexts[i].lat[op], 1);
+			memset(contexts[i].lat, 0, sizeof(contexts[i].lat));
+			/* Every completion was consumed, so the board starts over */
+			contexts[i].nxt_comp = 0;
+		}
+		printf("%12.0f %12.0f %10.1f %10.1f %10.1f %10.1f\n", rate, achieved,
+				hist_percentile(&all, 0.5) / 1e3, hist_percentile(&all, 0.99) / 1e3,
+				hist_percentile(&all, 0.999) / 1e3, all.max / 1e3);
+		fflush(stdout);
+		if (achieved < SWEEP_SATURATED * rate)
+			break;
+		knee = rate;
+	}
+	if (knee)
+		printf("Knee: %.0f requests/s is the highest rate the server sustained\n", knee);
+	else
+		printf("Knee: the server was saturated at the first rate - start lower\n");
+	fflush(stdout);
+}
+
 int main(int argc, char *argv[]) {
 	if (parse_args(argc, argv) != 0)
 		exit(EXIT_FAILURE);
 
+	/* Thread 0's CPU and the memory policy decide where the shared region's
+	 * pages land, as init_client touches all of them */
+	affinity_pin(&placement, 0);
+	if (mem_policy && affinity_mempolicy(mem_policy) < 0) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
 	init_client();
 
 	read_input_files();
+	init_contexts();
 
 	struct timespec s, e;
+	uint64_t start = stats_now();
 	clock_gettime(CLOCK_REALTIME, &s);
 
-	start_threads();
-	wait_for_threads();
+	if (rate_step) {
+		sweep();
+	} else {
+		start_threads();
+		wait_for_threads();
+	}
 
 	clock_gettime(CLOCK_REALTIME, &e);
 
 	/* Kill the server app */
 	if (child_pid > 0)
-		kill(child_pid, SIGKILL);
+	{
+		/* SIGTERM lets the server print its reports before exiting */
+		kill(child_pid, SIGTERM);
+		waitpid(child_pid, NULL, 0);
+	}
 
+	if (samples_file && write_samples(start) < 0)
+		return 1;
+	if (rate_step)
+		return 0;
 	return process_results(&s, &e);
 }
@@ -1,5 +1,6 @@
 #pragma once
 #include <stdint.h> 
+#include <string.h>
 
 typedef uint32_t key_type;
 typedef uint32_t value_type;
@@ -8,3 +9,72 @@ typedef uint32_t index_t;
 static index_t hash_function(key_type k, int table_size) {
 	return k % table_size;
 }
+
+/*
+ * Hash family for power-of-two tables - callers mask (or shift) the 32-bit
+ * result instead of dividing by the table size
+ */
+enum HASH_KIND {
+	HASH_MOD = 0,	/* identity - "k mod table size" once masked; keeps runs of sequential keys together */
+	HASH_FIBONACCI,	/* multiply by 2^32 / golden ratio - one multiply, spreads sequential keys */
+	HASH_MURMUR3	/* murmur3 fmix32 finalizer - full avalanche, a few more cycles */
+};
+#define NUM_HASH_KINDS 3
+
+static inline uint32_t hash_mod(key_type k) {
+	return k;
+}
+
+static inline uint32_t hash_fibonacci(key_type k) {
+	return k * 2654435769u;
+}
+
+static inline uint32_t hash_murmur3(key_type k) {
+	k ^= k >> 16;
+	k *= 0x85ebca6bu;
+	k ^= k >> 13;
+	k *= 0xc2b2ae35u;
+	k ^= k >> 16;
+	return k;
+}
+
+static inline uint32_t hash_key(enum HASH_KIND kind, key_type k) {
+	switch (kind) {
+	case HASH_MOD:
+		return hash_mod(k);
+	case HASH_FIBONACCI:
+		return hash_fibonacci(k);
+	default:
+		return hash_murmur3(k);
+	}
+}
+
+static inline const char *hash_name(enum HASH_KIND kind) {
+	static const char *names[NUM_HASH_KINDS] = { "mod", "fib", "murmur3" };
+	return kind < NUM_HASH_KINDS ? names[kind] : "?";
+}
+
+/*
+ * hash_key with its useful bits at the top - power-of-two tables index with
+ * the top bits, as a multiplicative hash only mixes upwards (bit i of
+ * k * 2654435769 depends on bits 0..i of k alone). The identity hash has its
+ * bits at the bottom, so they are reversed, which still sends a run of
+ * sequential keys to distinct buckets
+ */
+static inline uint32_t hash_top(enum HASH_KIND kind, key_type k) {
+	uint32_t h = hash_key(kind, k);
+	if (kind != HASH_MOD)
+		return h;
+	h = ((h >> 1) & 0x55555555u) | ((h & 0x55555555u) << 1);
+	h = ((h >> 2) & 0x33333333u) | ((h & 0x33333333u) << 2);
+	h = ((h >> 4) & 0x0f0f0f0fu) | ((h & 0x0f0f0f0fu) << 4);
+	return __builtin_bswap32(h);
+}
+
+/* @return the hash kind called name, or -1 */
+static inline int hash_parse(const char *name) {
+	for (int i = 0; i < NUM_HASH_KINDS; i++)
+		if (!strcmp(name, hash_name(i)))
+			return i;
+	return -1;
+}
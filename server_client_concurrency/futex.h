@@ -0,0 +1,67 @@
+#pragma once
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/* Busy-wait hint - lets the sibling hyperthread run and saves power */
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+/* Futex words live in the shared memory region, so these are the shared
+ * (non FUTEX_PRIVATE_FLAG) variants */
+static inline void futex_wait(uint32_t *addr, uint32_t val) {
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+/* As futex_wait, but gives up after ns nanoseconds */
+static inline void futex_wait_for(uint32_t *addr, uint32_t val, uint64_t ns) {
+	struct timespec ts = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 };
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static inline void futex_wake(uint32_t *addr, int n) {
+	syscall(SYS_futex, addr, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+/*
+ * Event counts - a 32-bit word that sleepers wait on and wakers bump
+ * The top bit says someone is (about to be) asleep, so a waker that finds it
+ * clear skips the FUTEX_WAKE syscall entirely
+ * Waiter:  key = evc_prepare(w); <re-check condition>; evc_wait(w, key);
+ * Waker:   <make condition true>; evc_notify(w);
+ */
+#define EVC_WAITERS 0x80000000u
+
+static inline uint32_t evc_prepare(uint32_t *evc) {
+	return atomic_fetch_or(evc, EVC_WAITERS) | EVC_WAITERS;
+}
+
+static inline void evc_wait(uint32_t *evc, uint32_t key) {
+	futex_wait(evc, key);
+}
+
+static inline void evc_wait_for(uint32_t *evc, uint32_t key, uint64_t ns) {
+	futex_wait_for(evc, key, ns);
+}
+
+static inline void evc_notify(uint32_t *evc) {
+	/* Orders the caller's publishing stores before the waiter flag load -
+	 * pairs with the atomic_fetch_or in evc_prepare */
+	atomic_thread_fence(memory_order_seq_cst);
+	uint32_t v = atomic_load_explicit(evc, memory_order_relaxed);
+	while (v & EVC_WAITERS) {
+		if (atomic_compare_exchange_weak(evc, &v, (v + 1) & ~EVC_WAITERS)) {
+			futex_wake(evc, INT_MAX);
+			break;
+		}
+	}
+}
@@ -0,0 +1,500 @@
+/*
+ * Generates a workload and its solution, like gen_workload.py but in
+ * parallel and in any size
+ * Requests are made in fixed-size chunks, each from its own stream of the
+ * seed, so the output never depends on the number of threads. Uniform and
+ * hotspot workloads take integer and basic double arithmetic only, so they
+ * are the same on any machine whose compiler does not fuse multiply-adds
+ * (gcc on x86-64 does not); zipf keys go through libm (see zipf.h), and are
+ * only the same where libm rounds alike.
+ * The solution is worked out by replaying the workload, each thread
+ * keeping the keys of one hash partition in a map of its own - the
+ * generator sorts each chunk by partition, so a thread only reads the
+ * requests of its own keys
+ */
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "workload.h"
+#include "zipf.h"
+
+#define MAX_THREADS 128
+/* Requests per chunk - part of the format of a seed's stream, so changing
+ * it changes every workload */
+#define CHUNK (1 << 20)
+/* Longest text line, "put 4294967295 4294967295\n" */
+#define MAX_LINE 26
+
+enum DIST {
+	DIST_UNIFORM = 0,
+	DIST_ZIPF,
+	DIST_HOTSPOT
+};
+
+uint64_t num_reqs = 100;
+double put_ratio = 0.5;
+double del_ratio = 0;
+enum DIST dist = DIST_UNIFORM;
+double skew = 0.99;
+double hot_keys = 0.2; /* share of the keys that are hot */
+double hot_ops = 0.8; /* share of the requests that go to them */
+uint64_t key_range = 0; /* keys are 1 .. key_range, 0 for num_reqs */
+uint64_t seed = 1;
+int num_threads = 1;
+int binary = 0;
+char *workload_file = NULL;
+char *solution_file = NULL;
+
+struct request *reqs;
+value_type *vals; /* result of each GET, in order */
+uint64_t num_chunks;
+uint64_t *chunk_gets; /* GETs in each chunk, then the GETs before it */
+uint64_t num_gets;
+/* Chunk c's requests, as offsets into it, sorted by partition - those of
+ * partition p are order[c][part_start[c][p] .. part_start[c][p + 1]) */
+uint32_t **order;
+uint32_t (*part_start)[MAX_THREADS + 1];
+
+/* Partition of k - not the bits the maps hash with, see map_slot */
+static int partition(key_type k) {
+	return ((uint64_t)hash_murmur3(k) * num_threads) >> 32;
+}
+
+/* Chunk c's stream of the seed */
+static void chunk_rng(struct rng *r, uint64_t c) {
+	rng_seed(r, seed ^ (c * 0x9e3779b97f4a7c15ULL));
+}
+
+static key_type next_key(struct rng *r, const struct zipf *z) {
+	uint64_t hot;
+
+	switch (dist) {
+	case DIST_ZIPF:
+		return zipf_next(z, r);
+	case DIST_HOTSPOT:
+		hot = hot_keys * key_range;
+		if (hot < 1)
+			hot = 1;
+		if (hot >= key_range || rng_double(r) < hot_ops)
+			return 1 + rng_below(r, hot);
+		return hot + 1 + rng_below(r, key_range - hot);
+	default:
+		return 1 + rng_below(r, key_range);
+	}
+}
+
+/*
+ * Fill the chunks of thread tid with requests, and sort each by partition
+ * A GET carries its number within the chunk in v until it is solved
+ */
+void *generate(void *arg) {
+	int tid = (intptr_t)arg;
+	struct zipf z = { 0 };
+
+	if (dist == DIST_ZIPF)
+		zipf_init(&z, key_range, skew);
+	for (uint64_t c = tid; c < num_chunks; c += num_threads) {
+		uint64_t start = c * CHUNK;
+		uint64_t end = (c + 1) * CHUNK < num_reqs ? (c + 1) * CHUNK : num_reqs;
+		uint32_t *next = part_start[c];
+		uint64_t gets = 0;
+		struct rng r;
+
+		chunk_rng(&r, c);
+		for (uint64_t i = start; i < end; i++) {
+			struct request q = { 0 };
+			double p = rng_double(&r);
+			q.k = next_key(&r, &z);
+			if (p < del_ratio) {
+				q.t = DEL;
+			} else if (p < del_ratio + (1 - del_ratio) * put_ratio) {
+				q.t = PUT;
+				q.v = 1 + rng_below(&r, UINT32_MAX);
+			} else {
+				q.t = GET;
+				q.v = gets++;
+			}
+			reqs[i] = q;
+			next[partition(q.k) + 1]++;
+		}
+		chunk_gets[c] = gets;
+
+		// Counting sort - next[p] ends up where partition p + 1 starts
+		if ((order[c] = malloc((end - start) * sizeof(uint32_t))) == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		for (int p = 1; p <= num_threads; p++)
+			next[p] += next[p - 1];
+		for (uint64_t i = start; i < end; i++)
+			order[c][next[partition(reqs[i].k)]++] = i - start;
+		for (int p = num_threads; p > 0; p--)
+			next[p] = next[p - 1];
+		next[0] = 0;
+	}
+	return NULL;
+}
+
+/*
+ * The keys of one partition - open addressing with linear probing
+ * A DEL leaves its key behind with value 0, which is what a GET of a
+ * missing key returns anyway
+ */
+struct map {
+	key_type *keys;		/* 0 for a free slot - keys start at 1 */
+	value_type *vals;
+	uint64_t count;
+	int bits;		/* 2^bits slots */
+};
+
+/* Home slot of k - from a hash of its own, independent of partition() */
+static uint64_t map_slot(struct map *m, key_type k) {
+	uint64_t x = k;
+	return splitmix64(&x) >> (64 - m->bits);
+}
+
+static void map_init(struct map *m, int bits) {
+	m->bits = bits;
+	m->count = 0;
+	m->keys = calloc((size_t)1 << bits, sizeof(key_type));
+	m->vals = malloc(((size_t)1 << bits) * sizeof(value_type));
+	if (m->keys == NULL || m->vals == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* @return k's slot - a free one if k is not in m */
+static uint64_t map_find(struct map *m, key_type k) {
+	uint64_t mask = ((uint64_t)1 << m->bits) - 1;
+	uint64_t i = map_slot(m, k);
+
+	while (m->keys[i] != 0 && m->keys[i] != k)
+		i = (i + 1) & mask;
+	return i;
+}
+
+static void map_put(struct map *m, key_type k, value_type v) {
+	uint64_t i = map_find(m, k);
+
+	if (m->keys[i] == 0) {
+		// Keep at most half the slots in use
+		if (2 * (m->count + 1) > (uint64_t)1 << m->bits) {
+			struct map big;
+			map_init(&big, m->bits + 1);
+			for (uint64_t j = 0; j < (uint64_t)1 << m->bits; j++)
+				if (m->keys[j]) {
+					uint64_t b = map_find(&big, m->keys[j]);
+					big.keys[b] = m->keys[j];
+					big.vals[b] = m->vals[j];
+				}
+			big.count = m->count;
+			free(m->keys);
+			free(m->vals);
+			*m = big;
+			i = map_find(m, k);
+		}
+		m->keys[i] = k;
+		m->count++;
+	}
+	m->vals[i] = v;
+}
+
+static value_type map_get(struct map *m, key_type k) {
+	uint64_t i = map_find(m, k);
+	return m->keys[i] ? m->vals[i] : 0;
+}
+
+/* Replay the requests of partition tid in order, filling in their GETs */
+void *solve(void *arg) {
+	int tid = (intptr_t)arg;
+	struct map m;
+
+	map_init(&m, 10);
+	for (uint64_t c = 0; c < num_chunks; c++) {
+		for (uint32_t j = part_start[c][tid]; j < part_start[c][tid + 1]; j++) {
+			struct request *q = &reqs[c * CHUNK + order[c][j]];
+			if (q->t == GET) {
+				vals[chunk_gets[c] + q->v] = map_get(&m, q->k);
+				q->v = 0;
+			} else if (q->t == PUT) {
+				map_put(&m, q->k, q->v);
+			} else if (map_get(&m, q->k)) {
+				map_put(&m, q->k, 0);
+			}
+		}
+	}
+	free(m.keys);
+	free(m.vals);
+	return NULL;
+}
+
+void run_threads(void *(*fn)(void *)) {
+	pthread_t threads[MAX_THREADS];
+
+	for (intptr_t i = 0; i < num_threads; i++)
+		if (pthread_create(&threads[i], NULL, fn, (void *)i))
+			perror("pthread_create");
+	for (int i = 0; i < num_threads; i++)
+		if (pthread_join(threads[i], NULL))
+			perror("pthread_join");
+}
+
+/*
+ * Create path as a binary file of count records of kind, mapped for writing
+ * @return the first record
+ */
+void *map_output(const char *path, enum WL_KIND kind, uint64_t count, size_t size) {
+	size_t bytes = sizeof(struct wl_header) + count * size;
+	FILE *f = fopen(path, "w+");
+	char *mem;
+
+	if (f == NULL || wl_write_header(f, kind, count) || fflush(f) ||
+			ftruncate(fileno(f), bytes)) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(f), 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	fclose(f);
+	return mem + sizeof(struct wl_header);
+}
+
+static char *put_u32(char *p, uint32_t v) {
+	char tmp[10];
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	while (n)
+		*p++ = tmp[--n];
+	return p;
+}
+
+/* Text chunks being formatted - thread i does chunk round * num_threads + i */
+struct text_job {
+	uint64_t round;
+	char *buf[MAX_THREADS];
+	size_t len[MAX_THREADS];
+	int solution;
+};
+struct text_job job;
+
+void *format_chunk(void *arg) {
+	int tid = (intptr_t)arg;
+	uint64_t c = job.round * num_threads + tid;
+	uint64_t total = job.solution ? num_gets : num_reqs;
+	uint64_t end = (c + 1) * CHUNK < total ? (c + 1) * CHUNK : total;
+	char *p = job.buf[tid];
+
+	for (uint64_t i = c * CHUNK; i < end; i++) {
+		if (job.solution) {
+			p = put_u32(p, vals[i]);
+		} else {
+			memcpy(p, reqs[i].t == PUT ? PUT_STR " " : reqs[i].t == GET ? GET_STR " " : DEL_STR " ", 4);
+			p = put_u32(p + 4, reqs[i].k);
+			if (reqs[i].t == PUT) {
+				*p++ = ' ';
+				p = put_u32(p, reqs[i].v);
+			}
+		}
+		*p++ = '\n';
+	}
+	job.len[tid] = p - job.buf[tid];
+	return NULL;
+}
+
+/* Write the requests (or the solution) to path as text, formatted in parallel */
+void write_text(const char *path, int solution) {
+	uint64_t total = solution ? num_gets : num_reqs;
+	FILE *f = fopen(path, "w");
+
+	if (f == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	job.solution = solution;
+	for (int i = 0; i < num_threads; i++)
+		if ((job.buf[i] = malloc((size_t)CHUNK * MAX_LINE)) == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+	for (job.round = 0; job.round * num_threads * CHUNK < total; job.round++) {
+		run_threads(format_chunk);
+		for (int i = 0; i < num_threads; i++)
+			if (fwrite(job.buf[i], 1, job.len[i], f) != job.len[i]) {
+				perror(path);
+				exit(EXIT_FAILURE);
+			}
+	}
+	for (int i = 0; i < num_threads; i++)
+		free(job.buf[i]);
+	if (fclose(f)) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void usage(char *name) {
+	printf("Usage: %s [-h] [-n num_reqs] [-r put_ratio] [-d del_ratio] [-D dist] [-s skew] [-H hot_keys:hot_ops] [-k key_range] [-S seed] [-t threads] [-b] [-o workload_file] [-e solution_file]\n", name);
+	printf("-h show this help\n");
+	printf("-n number of requests (default: 100)\n");
+	printf("-r share of the requests that are not deletes that are puts (default: 0.5)\n");
+	printf("-d share of the requests that are deletes (default: 0)\n");
+	printf("-D key distribution: uniform, zipf or hotspot (default: uniform)\n");
+	printf("-s zipf exponent, key 1 being the most popular (default: 0.99)\n");
+	printf("   zipf keys are computed with libm's log and exp, which are not correctly rounded - the same seed gives the same keys with the same libm on the same kind of CPU only\n");
+	printf("-H hotspot: the first hot_keys of the key range get hot_ops of the requests (default: 0.2:0.8)\n");
+	printf("-k keys are 1 .. key_range (default: num_reqs)\n");
+	printf("-S random seed - the output depends on it and the options, not on -t (default: 1); see -s for zipf\n");
+	printf("-t threads generating (default: 1)\n");
+	printf("-b write the binary format the client maps (see wlconvert) instead of text\n");
+	printf("-o workload file (default: workload.txt, workload.bin with -b)\n");
+	printf("-e solution file (default: solution.txt, solution.bin with -b)\n");
+}
+
+static int parse_args(int argc, char **argv) {
+	int op;
+	while ((op = getopt(argc, argv, "hn:r:d:D:s:H:k:S:t:bo:e:")) != -1) {
+		switch (op) {
+		case 'h':
+		usage(argv[0]);
+		exit(EXIT_SUCCESS);
+		break;
+
+		case 'n':
+		num_reqs = strtoull(optarg, NULL, 0);
+		break;
+
+		case 'r':
+		put_ratio = atof(optarg);
+		break;
+
+		case 'd':
+		del_ratio = atof(optarg);
+		break;
+
+		case 'D':
+		if (!strcmp(optarg, "uniform"))
+			dist = DIST_UNIFORM;
+		else if (!strcmp(optarg, "zipf"))
+			dist = DIST_ZIPF;
+		else if (!strcmp(optarg, "hotspot"))
+			dist = DIST_HOTSPOT;
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+		break;
+
+		case 's':
+		skew = atof(optarg);
+		break;
+
+		case 'H':
+		if (sscanf(optarg, "%lf:%lf", &hot_keys, &hot_ops) != 2) {
+			usage(argv[0]);
+			return 1;
+		}
+		break;
+
+		case 'k':
+		key_range = strtoull(optarg, NULL, 0);
+		break;
+
+		case 'S':
+		seed = strtoull(optarg, NULL, 0);
+		break;
+
+		case 't':
+		num_threads = atoi(optarg);
+		break;
+
+		case 'b':
+		binary = 1;
+		break;
+
+		case 'o':
+		workload_file = optarg;
+		break;
+
+		case 'e':
+		solution_file = optarg;
+		break;
+
+		default:
+		usage(argv[0]);
+		return 1;
+		}
+	}
+	if (key_range == 0)
+		key_range = num_reqs;
+	if (num_reqs < 1 || key_range > UINT32_MAX || put_ratio < 0 || put_ratio > 1 ||
+			del_ratio < 0 || del_ratio > 1 || skew <= 0 || hot_keys <= 0 || hot_keys > 1 ||
+			hot_ops < 0 || hot_ops > 1 || num_threads < 1 || num_threads > MAX_THREADS) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (workload_file == NULL)
+		workload_file = binary ? "workload.bin" : "workload.txt";
+	if (solution_file == NULL)
+		solution_file = binary ? "solution.bin" : "solution.txt";
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	if (parse_args(argc, argv) != 0)
+		exit(EXIT_FAILURE);
+	num_chunks = (num_reqs + CHUNK - 1) / CHUNK;
+	if ((chunk_gets = calloc(num_chunks, sizeof(uint64_t))) == NULL ||
+			(order = calloc(num_chunks, sizeof(uint32_t *))) == NULL ||
+			(part_start = calloc(num_chunks, sizeof(*part_start))) == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Binary output is generated straight into the files */
+	if (binary)
+		reqs = map_output(workload_file, WL_REQUESTS, num_reqs, sizeof(struct request));
+	else if ((reqs = malloc(num_reqs * sizeof(struct request))) == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	run_threads(generate);
+
+	for (uint64_t c = 0; c < num_chunks; c++) {
+		uint64_t gets = chunk_gets[c];
+		chunk_gets[c] = num_gets;
+		num_gets += gets;
+	}
+	if (binary)
+		vals = map_output(solution_file, WL_SOLUTION, num_gets, sizeof(value_type));
+	else if ((vals = malloc((num_gets + 1) * sizeof(value_type))) == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	run_threads(solve);
+	for (uint64_t c = 0; c < num_chunks; c++)
+		free(order[c]);
+
+	if (!binary) {
+		write_text(workload_file, 0);
+		write_text(solution_file, 1);
+	}
+	printf("%" PRIu64 " requests (%" PRIu64 " gets) written to %s, their results to %s\n",
+			num_reqs, num_gets, workload_file, solution_file);
+	return 0;
+}
@@ -0,0 +1,739 @@
+#include "hash_table.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define EPOCH_OFFLINE UINT64_MAX
+
+// Id the calling thread went online with, -1 while it is offline
+static __thread int self = -1;
+
+// Reads that may race with a writer - validated by the shard seqlock
+#define RACY(x) atomic_load_explicit(&(x), memory_order_relaxed)
+// Probe distance of an occupied meta byte, tombstone or not
+#define META_DIST(m) ((uint32_t)((m) & ~HT_DEAD) - 1)
+
+static inline uint32_t ht_hash(hash_table *t, key_type k) {
+    return hash_top(t->hash, k);
+}
+
+// The top bits of the hash pick the shard...
+static inline uint32_t shard_index(hash_table *t, uint32_t h) {
+    return t->shard_bits ? h >> (32 - t->shard_bits) : 0;
+}
+
+// ...and the bits below them the slot within it (see gen_home)
+static inline uint32_t home_hash(hash_table *t, uint32_t h) {
+    return h << t->shard_bits;
+}
+
+// Home slot in g of a key with home_hash hh - its top log2(capacity) bits
+static inline uint32_t gen_home(struct ht_gen *g, uint32_t hh) {
+    return hh >> __builtin_clz(g->mask);
+}
+
+static uint32_t round_pow2(uint32_t n) {
+    uint32_t p = 1;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+/*
+ * What a table file holds besides the generations - the shards, with
+ * generation pointers turned into offsets into the file
+ */
+struct ht_file_shard {
+    uint64_t cur;
+    uint64_t old;
+    uint32_t migrate_pos;
+    uint32_t old_left;
+};
+
+struct ht_file_root {
+    uint32_t num_shards;
+    uint32_t hash;
+    struct ht_file_shard shards[];
+};
+
+static uint32_t meta_bytes(uint32_t capacity) {
+    return (capacity + 3) & ~3u;
+}
+
+static uint64_t gen_bytes(uint32_t capacity) {
+    return sizeof(struct ht_gen) + meta_bytes(capacity) +
+        (uint64_t)capacity * (sizeof(key_type) + sizeof(value_type));
+}
+
+// Point meta/keys/vals at the arrays that follow the header
+static void gen_layout(struct ht_gen *g) {
+    g->meta = (uint8_t *)(g + 1);
+    g->keys = (key_type *)(g->meta + meta_bytes(g->capacity));
+    g->vals = (value_type *)(g->keys + g->capacity);
+}
+
+// Allocate an empty generation with capacity slots
+static struct ht_gen *gen_alloc(hash_table *t, uint32_t capacity) {
+    struct ht_gen *g;
+    if (t->arena)
+        g = arena_ptr(t->arena, arena_alloc(t->arena, __builtin_ctz(capacity), gen_bytes(capacity)));
+    else
+        g = pool_alloc(t->pool, self, __builtin_ctz(capacity), gen_bytes(capacity));
+    if (g == NULL)
+        return NULL;
+
+    g->capacity = capacity;
+    g->mask = capacity - 1;
+    g->count = 0;
+    g->dead = 0;
+    gen_layout(g);
+    // A recycled block holds an old generation - only meta has to be cleared,
+    // keys and values are never read in an empty slot
+    if (t->pool)
+        memset(g->meta, 0, meta_bytes(capacity));
+    return g;
+}
+
+static void gen_free(hash_table *t, struct ht_gen *g) {
+    if (g == NULL)
+        return;
+    if (t->arena)
+        arena_free(t->arena, arena_off(t->arena, g), __builtin_ctz(g->capacity));
+    else
+        pool_free(t->pool, self, __builtin_ctz(g->capacity), g, gen_bytes(g->capacity));
+}
+
+// Free every retired generation that no online thread can still be reading
+static void reclaim(hash_table *t) {
+    uint64_t min = EPOCH_OFFLINE;
+
+    pthread_mutex_lock(&t->retire_lock);
+    for (int i = 0; i < HT_MAX_THREADS; i++) {
+        uint64_t e = atomic_load(&t->threads[i].epoch);
+        if (e < min)
+            min = e;
+    }
+    struct ht_gen **pp = &t->retired;
+    while (*pp) {
+        struct ht_gen *g = *pp;
+        if (g->retire_epoch < min) {
+            *pp = g->next_retired;
+            gen_free(t, g);
+        } else {
+            pp = &g->next_retired;
+        }
+    }
+    pthread_mutex_unlock(&t->retire_lock);
+}
+
+// Hand an unlinked generation to the reclaimer - readers that came online
+// before this call may still be probing it
+static void gen_retire(hash_table *t, struct ht_gen *g) {
+    pthread_mutex_lock(&t->retire_lock);
+    g->retire_epoch = atomic_fetch_add(&t->epoch, 1);
+    g->next_retired = t->retired;
+    t->retired = g;
+    pthread_mutex_unlock(&t->retire_lock);
+}
+
+void ht_online(hash_table *t, int tid) {
+    self = tid;
+    atomic_store(&t->threads[tid].epoch, atomic_load(&t->epoch));
+    if (atomic_load_explicit(&t->retired, memory_order_relaxed))
+        reclaim(t);
+}
+
+void ht_offline(hash_table *t, int tid) {
+    self = -1;
+    atomic_store_explicit(&t->threads[tid].epoch, EPOCH_OFFLINE, memory_order_release);
+}
+
+// Make the shard's seqlock odd before the first entry moves - a no-op if this
+// critical section already did
+static inline void seq_open(struct ht_shard *s) {
+    if (!(s->seq & 1)) {
+        atomic_store_explicit(&s->seq, s->seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+    }
+}
+
+static inline void seq_close(struct ht_shard *s) {
+    if (s->seq & 1)
+        atomic_store_explicit(&s->seq, s->seq + 1, memory_order_release);
+}
+
+// @return the slot holding k in g, -1 if there is none - hh is home_hash()
+// The slot may be a tombstone, check meta for HT_DEAD
+// Safe to call without the lock - RACY reads and the bounded probe keep a
+// reader inside g even if a writer is reshuffling it
+static int64_t gen_find(struct ht_gen *g, key_type k, uint32_t hh) {
+    uint32_t pos = gen_home(g, hh);
+    for (uint32_t dist = 0; ; dist++, pos = (pos + 1) & g->mask) {
+        uint8_t m = RACY(g->meta[pos]);
+        // An empty slot, or an entry closer to home than we would be, ends the probe
+        if (m == 0 || META_DIST(m) < dist)
+            return -1;
+        if (RACY(g->keys[pos]) == k)
+            return pos;
+    }
+}
+
+// Robin Hood insert - walks from the home slot, taking the place of any entry
+// that is closer to its own home than we are to ours. A tombstone in such a
+// place is simply overwritten.
+// @return 0 if done, -1 if a probe distance would no longer fit in a byte - in
+// that case *k/*v hold the entry that is still homeless (not necessarily the
+// one we started with) and the caller must grow g and insert it again
+static int gen_insert(hash_table *t, struct ht_gen *g, key_type *kp, value_type *vp) {
+    key_type k = *kp;
+    value_type v = *vp;
+    uint32_t pos = gen_home(g, home_hash(t, ht_hash(t, k)));
+    uint32_t dist = 0;
+    int displaced = 0;
+
+    while (1) {
+        uint8_t m = g->meta[pos];
+        if (m == 0 || ((m & HT_DEAD) && META_DIST(m) <= dist)) {
+            if (m == 0)
+                g->count++;
+            else
+                g->dead--;
+            g->meta[pos] = dist + 1;
+            g->keys[pos] = k;
+            g->vals[pos] = v;
+            return 0;
+        }
+        // Only the original key can already be present, and only before
+        // the first swap (Robin Hood ordering guarantees that)
+        if (!displaced && g->keys[pos] == k) {
+            g->vals[pos] = v;
+            return 0;
+        }
+        if (META_DIST(m) < dist) {
+            key_type tk = g->keys[pos];
+            value_type tv = g->vals[pos];
+            g->meta[pos] = dist + 1;
+            g->keys[pos] = k;
+            g->vals[pos] = v;
+            k = tk;
+            v = tv;
+            dist = m - 1;
+            displaced = 1;
+        }
+        pos = (pos + 1) & g->mask;
+        if (++dist > HT_MAX_DIST) {
+            *kp = k;
+            *vp = v;
+            return -1;
+        }
+    }
+}
+
+// Copy the live entries of g into a generation with at least twice the
+// capacity, all at once
+// Only used when a probe sequence overflows, which takes pathological clustering
+static struct ht_gen *gen_rebuild(hash_table *t, struct ht_gen *g) {
+    for (uint32_t cap = g->capacity * 2; ; cap *= 2) {
+        struct ht_gen *n = cap ? gen_alloc(t, cap) : NULL;
+        uint32_t i;
+        if (n == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (i = 0; i < g->capacity; i++) {
+            key_type k = g->keys[i];
+            value_type v = g->vals[i];
+            if (g->meta[i] && !(g->meta[i] & HT_DEAD) && gen_insert(t, n, &k, &v) < 0)
+                break;
+        }
+        if (i == g->capacity)
+            return n;
+        // g is intact, try bigger
+        gen_free(t, n);
+    }
+}
+
+// Insert into the current generation, rebuilding it if a probe overflows
+// Caller holds the lock and has opened the seqlock
+static void cur_insert(hash_table *t, struct ht_shard *s, key_type k, value_type v) {
+    while (gen_insert(t, s->cur, &k, &v) < 0) {
+        struct ht_gen *g = s->cur;
+        atomic_store_explicit(&s->cur, gen_rebuild(t, g), memory_order_release);
+        gen_retire(t, g);
+    }
+}
+
+// Move up to n slots of the old generation into cur, dropping tombstones
+// Caller holds the lock
+static void shard_migrate(hash_table *t, struct ht_shard *s, uint32_t n) {
+    struct ht_gen *old = s->old;
+    if (old == NULL)
+        return;
+
+    seq_open(s);
+    uint32_t end = old->capacity;
+    if (n < end - s->migrate_pos)
+        end = s->migrate_pos + n;
+    for (uint32_t i = s->migrate_pos; i < end; i++) {
+        if (old->meta[i]) {
+            if (!(old->meta[i] & HT_DEAD)) {
+                cur_insert(t, s, old->keys[i], old->vals[i]);
+                // Once in cur the key may be deleted and its tombstone
+                // reused, and the copy left behind must not show through
+                old->meta[i] |= HT_DEAD;
+            }
+            s->old_left--;
+        }
+    }
+    s->migrate_pos = end;
+    if (end == old->capacity) {
+        atomic_store_explicit(&s->old, NULL, memory_order_relaxed);
+        gen_retire(t, old);
+    }
+}
+
+// Start moving the shard into a generation sized for its live entries plus
+// one about to be inserted - twice as large when the shard filled up with
+// live entries, the same size when tombstones filled it, smaller when
+// deletes emptied it
+static void shard_start_resize(hash_table *t, struct ht_shard *s) {
+    // Still draining the previous resize - finish that one first
+    shard_migrate(t, s, UINT32_MAX);
+
+    uint64_t live = (uint64_t)s->cur->count - s->cur->dead + 1;
+    uint32_t capacity = s->cur->capacity;
+    while (live * HT_MAX_LOAD_DEN > (uint64_t)capacity * HT_MAX_LOAD_NUM)
+        capacity *= 2;
+    // Halving stops while the live entries still fill more than a quarter of
+    // the maximum load, so a shrunken shard does not start growing right away
+    while (capacity > HT_MIN_CAPACITY &&
+            live * HT_MAX_LOAD_DEN * 4 < (uint64_t)capacity * HT_MAX_LOAD_NUM)
+        capacity /= 2;
+
+    struct ht_gen *g = gen_alloc(t, capacity);
+    if (g == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    seq_open(s);
+    atomic_store_explicit(&s->old, s->cur, memory_order_relaxed);
+    atomic_store_explicit(&s->cur, g, memory_order_release);
+    s->migrate_pos = 0;
+    s->old_left = s->old->count;
+}
+
+// @return the generation at off if its header is sane, NULL otherwise - the
+// cost does not depend on how many keys it holds
+static struct ht_gen *gen_check(struct arena *a, uint64_t off) {
+    struct ht_gen *g = arena_ptr(a, off);
+    uint64_t used = a->hdr->used;
+
+    if (off < sizeof(struct arena_header) || off + sizeof(struct ht_gen) > used)
+        return NULL;
+    if (g->capacity < HT_MIN_CAPACITY || (g->capacity & g->mask) ||
+            g->mask != g->capacity - 1 || off + gen_bytes(g->capacity) > used ||
+            g->count > g->capacity || g->dead > g->count)
+        return NULL;
+    // The pointers are from the previous mapping
+    gen_layout(g);
+    return g;
+}
+
+// Bring back the shards of a cleanly closed file - @return 0 on success, -1
+// if anything looks off
+static int file_restore(hash_table *t) {
+    struct arena *a = t->arena;
+    struct ht_file_root *root = arena_ptr(a, a->hdr->root);
+
+    if (root == NULL || a->hdr->root + sizeof(struct ht_file_root) +
+            t->num_shards * sizeof(struct ht_file_shard) > a->hdr->used)
+        return -1;
+    for (uint32_t i = 0; i < t->num_shards; i++) {
+        struct ht_file_shard *fs = &root->shards[i];
+        struct ht_shard *s = &t->shards[i];
+        if ((s->cur = gen_check(a, fs->cur)) == NULL)
+            return -1;
+        s->old = NULL;
+        if (fs->old && ((s->old = gen_check(a, fs->old)) == NULL ||
+                    fs->migrate_pos > s->old->capacity || fs->old_left > s->old->count))
+            return -1;
+        s->migrate_pos = fs->migrate_pos;
+        s->old_left = fs->old_left;
+    }
+    return 0;
+}
+
+// Map cfg->file - @return 1 if the table was restored from it, 0 if it is
+// empty and the shards still need generations, -1 on failure
+static int file_open(hash_table *t, const char *path) {
+    struct ht_file_root *root;
+    int rc;
+
+    if ((t->arena = calloc(1, sizeof(struct arena))) == NULL)
+        return -1;
+    if ((rc = arena_open(t->arena, path)) < 0)
+        return -1;
+    if (rc == 1) {
+        root = arena_ptr(t->arena, t->arena->hdr->root);
+        // Keys would land in different shards - refuse rather than lose them
+        if (root && (root->num_shards != t->num_shards || root->hash != t->hash)) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (file_restore(t) == 0)
+            return 1;
+        if (arena_reset(t->arena))
+            return -1;
+    }
+
+    uint64_t off = arena_alloc(t->arena, ARENA_PERMANENT, sizeof(struct ht_file_root) +
+            t->num_shards * sizeof(struct ht_file_shard));
+    if ((root = arena_ptr(t->arena, off)) == NULL)
+        return -1;
+    root->num_shards = t->num_shards;
+    root->hash = t->hash;
+    t->arena->hdr->root = off;
+    return 0;
+}
+
+// Write the shard headers and mark the file clean - writers must be locked out
+static void file_close(hash_table *t) {
+    struct ht_file_root *root = arena_ptr(t->arena, t->arena->hdr->root);
+
+    for (uint32_t i = 0; i < t->num_shards; i++) {
+        struct ht_shard *s = &t->shards[i];
+        root->shards[i].cur = arena_off(t->arena, s->cur);
+        root->shards[i].old = arena_off(t->arena, s->old);
+        root->shards[i].migrate_pos = s->migrate_pos;
+        root->shards[i].old_left = s->old_left;
+    }
+    if (arena_close(t->arena))
+        perror("msync");
+}
+
+hash_table *ht_create(const struct ht_config *cfg) {
+    hash_table *t;
+    uint32_t num_shards = cfg->num_shards;
+    if (posix_memalign((void **)&t, 64, sizeof(hash_table)))
+        return NULL;
+
+    if (stripes_init(&t->locks, cfg->num_stripes ? cfg->num_stripes : 1, cfg->lock_kind) < 0) {
+        free(t);
+        return NULL;
+    }
+    // A stripe covers whole shards - more stripes than shards would never be used
+    if (num_shards < t->locks.num)
+        num_shards = t->locks.num;
+    t->num_shards = round_pow2(num_shards ? num_shards : 1);
+    t->shard_bits = __builtin_ctz(t->num_shards);
+    t->hash = cfg->hash;
+    if (posix_memalign((void **)&t->shards, 64, t->num_shards * sizeof(struct ht_shard))) {
+        stripes_destroy(&t->locks);
+        free(t);
+        return NULL;
+    }
+
+    pthread_mutex_init(&t->retire_lock, NULL);
+    t->retired = NULL;
+    t->epoch = 1;
+    for (int i = 0; i < HT_MAX_THREADS; i++)
+        t->threads[i].epoch = EPOCH_OFFLINE;
+    for (uint32_t i = 0; i < t->num_shards; i++) {
+        struct ht_shard *s = &t->shards[i];
+        s->seq = 0;
+        s->cur = NULL;
+        s->old = NULL;
+        s->migrate_pos = 0;
+        s->old_left = 0;
+        s->version = 0;
+    }
+
+    t->pool = NULL;
+    t->arena = NULL;
+    t->restored = 0;
+    t->log = NULL;
+    t->log_arg = NULL;
+    if (cfg->file == NULL) {
+        if ((t->pool = malloc(sizeof(struct pool))) == NULL)
+            goto fail;
+        int mb = cfg->pool_mb ? cfg->pool_mb : HT_DEFAULT_POOL_MB;
+        pool_init(t->pool, mb > 0 ? (uint64_t)mb << 20 : 0);
+    } else {
+        int rc = file_open(t, cfg->file);
+        if (rc < 0)
+            goto fail;
+        if ((t->restored = rc))
+            return t;
+    }
+
+    uint32_t per_shard = round_pow2(cfg->init_size / t->num_shards);
+    if (per_shard < HT_MIN_CAPACITY)
+        per_shard = HT_MIN_CAPACITY;
+    for (uint32_t i = 0; i < t->num_shards; i++) {
+        if ((t->shards[i].cur = gen_alloc(t, per_shard)) == NULL)
+            goto fail;
+        // gen_alloc only writes meta - touch the keys and values here too, so
+        // all of the initial table lands where the caller's memory policy says
+        memset(t->shards[i].cur->keys, 0,
+                (size_t)per_shard * (sizeof(key_type) + sizeof(value_type)));
+    }
+    return t;
+
+fail:
+    if (t->pool) {
+        for (uint32_t i = 0; i < t->num_shards; i++)
+            gen_free(t, t->shards[i].cur);
+        pool_destroy(t->pool);
+        free(t->pool);
+    } else if (t->arena) {
+        // The file is still marked dirty, so nothing in it will be trusted
+        if (t->arena->base && t->arena->base != MAP_FAILED) {
+            munmap(t->arena->base, ARENA_MAX_SIZE);
+            close(t->arena->fd);
+        }
+        free(t->arena);
+    }
+    stripes_destroy(&t->locks);
+    free(t->shards);
+    free(t);
+    return NULL;
+}
+
+void ht_destroy(hash_table *t) {
+    if (t->arena) {
+        // The generations live in the file - keep them
+        reclaim(t);
+        file_close(t);
+        munmap(t->arena->base, ARENA_MAX_SIZE);
+        close(t->arena->fd);
+        free(t->arena);
+    } else {
+        for (uint32_t i = 0; i < t->num_shards; i++) {
+            gen_free(t, t->shards[i].cur);
+            gen_free(t, t->shards[i].old);
+        }
+        while (t->retired) {
+            struct ht_gen *g = t->retired;
+            t->retired = g->next_retired;
+            gen_free(t, g);
+        }
+        pool_destroy(t->pool);
+        free(t->pool);
+    }
+    pthread_mutex_destroy(&t->retire_lock);
+    stripes_destroy(&t->locks);
+    free(t->shards);
+    free(t);
+}
+
+void ht_lock_all(hash_table *t) {
+    for (uint32_t i = 0; i < t->locks.num; i++)
+        stripe_lock(&t->locks, i);
+}
+
+void ht_unlock_all(hash_table *t) {
+    for (uint32_t i = 0; i < t->locks.num; i++)
+        stripe_unlock(&t->locks, i);
+}
+
+void ht_persist(hash_table *t) {
+    if (t->arena == NULL)
+        return;
+    // Never unlocked - see the header
+    ht_lock_all(t);
+    // Whatever online readers may still see stays allocated in the file
+    reclaim(t);
+    file_close(t);
+}
+
+value_type ht_put(hash_table *t, key_type k, value_type v) {
+    uint32_t h = ht_hash(t, k);
+    uint32_t idx = shard_index(t, h);
+    uint32_t hh = home_hash(t, h);
+    struct ht_shard *s = &t->shards[idx];
+    struct ht_gen *g;
+    value_type old = 0;
+    int64_t pos;
+
+    stripe_lock(&t->locks, idx);
+    shard_migrate(t, s, HT_MIGRATE_STEP);
+    // Not migrated yet - a live entry in old moves over with its new value
+    // later. Tombstones in old are as good as empty slots.
+    if ((pos = gen_find(g = s->cur, k, hh)) >= 0 ||
+            (s->old && (pos = gen_find(g = s->old, k, hh)) >= 0 &&
+             !(g->meta[pos] & HT_DEAD))) {
+        if (g->meta[pos] & HT_DEAD) {
+            // Reviving a tombstone - readers must not pair the live bit with
+            // the value it had before the delete
+            seq_open(s);
+            g->vals[pos] = v;
+            g->meta[pos] &= ~HT_DEAD;
+            g->dead--;
+        } else {
+            old = g->vals[pos];
+            atomic_store_explicit(&g->vals[pos], v, memory_order_relaxed);
+        }
+    } else {
+        uint64_t entries = (uint64_t)s->cur->count + s->old_left + 1;
+        if (entries * HT_MAX_LOAD_DEN > (uint64_t)s->cur->capacity * HT_MAX_LOAD_NUM)
+            shard_start_resize(t, s);
+        seq_open(s);
+        cur_insert(t, s, k, v);
+    }
+    seq_close(s);
+    // After the value is in place - a reader that saw the old version may
+    // have read either value, one that sees the new version reads ours
+    atomic_store_explicit(&s->version, s->version + 1, memory_order_release);
+    if (t->log)
+        t->log(t->log_arg, 0, k, v);
+    stripe_unlock(&t->locks, idx);
+    return old;
+}
+
+// Look k up in the shard - caller either holds the lock or validates with seq
+static value_type shard_lookup(struct ht_shard *s, key_type k, uint32_t hh) {
+    struct ht_gen *g = atomic_load_explicit(&s->cur, memory_order_acquire);
+    int64_t pos;
+
+    if ((pos = gen_find(g, k, hh)) < 0) {
+        g = atomic_load_explicit(&s->old, memory_order_acquire);
+        if (g == NULL || (pos = gen_find(g, k, hh)) < 0)
+            return 0;
+    }
+    if (RACY(g->meta[pos]) & HT_DEAD)
+        return 0;
+    return RACY(g->vals[pos]);
+}
+
+// Lock-free read validated by the seqlock, falling back to the lock
+static value_type shard_get(hash_table *t, uint32_t idx, key_type k, uint32_t hh) {
+    struct ht_shard *s = &t->shards[idx];
+    value_type v;
+
+    for (int i = 0; i < HT_READ_RETRIES; i++) {
+        uint32_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+        if (seq & 1) {
+            cpu_relax();
+            continue;
+        }
+        v = shard_lookup(s, k, hh);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&s->seq, memory_order_relaxed) == seq)
+            return v;
+    }
+
+    // Lost the race too often - wait our turn behind the writers
+    stripe_lock(&t->locks, idx);
+    v = shard_lookup(s, k, hh);
+    stripe_unlock(&t->locks, idx);
+    return v;
+}
+
+value_type ht_get(hash_table *t, key_type k) {
+    uint32_t h = ht_hash(t, k);
+    return shard_get(t, shard_index(t, h), k, home_hash(t, h));
+}
+
+value_type ht_get_versioned(hash_table *t, key_type k, uint32_t *version) {
+    uint32_t h = ht_hash(t, k);
+    uint32_t idx = shard_index(t, h);
+
+    *version = atomic_load_explicit(&t->shards[idx].version, memory_order_acquire);
+    return shard_get(t, idx, k, home_hash(t, h));
+}
+
+int ht_del(hash_table *t, key_type k, value_type *old) {
+    uint32_t h = ht_hash(t, k);
+    uint32_t idx = shard_index(t, h);
+    uint32_t hh = home_hash(t, h);
+    struct ht_shard *s = &t->shards[idx];
+    struct ht_gen *g;
+    int64_t pos;
+    int found = 0;
+
+    stripe_lock(&t->locks, idx);
+    // Deletes drive migration too, or a shard that only sees DELs and GETs
+    // would never finish compacting
+    shard_migrate(t, s, HT_MIGRATE_STEP);
+    if ((pos = gen_find(g = s->cur, k, hh)) >= 0 ||
+            (s->old && (pos = gen_find(g = s->old, k, hh)) >= 0)) {
+        if (!(g->meta[pos] & HT_DEAD)) {
+            // A single store, like an overwrite - no need for the seqlock
+            atomic_store_explicit(&g->meta[pos], g->meta[pos] | HT_DEAD,
+                    memory_order_relaxed);
+            g->dead++;
+            found = 1;
+            if (old)
+                *old = g->vals[pos];
+        }
+    }
+    struct ht_gen *cur = s->cur;
+    if (found && s->old == NULL && cur->capacity > HT_MIN_CAPACITY &&
+            ((uint64_t)cur->dead * 4 >= cur->capacity ||
+             (uint64_t)(cur->count - cur->dead) * 8 < cur->capacity))
+        shard_start_resize(t, s);
+    seq_close(s);
+    atomic_store_explicit(&s->version, s->version + 1, memory_order_release);
+    if (found && t->log)
+        t->log(t->log_arg, 1, k, 0);
+    stripe_unlock(&t->locks, idx);
+    return found;
+}
+
+void ht_alloc_report(hash_table *t, FILE *out) {
+    if (t->pool) {
+        pool_report(t->pool, "generations", out);
+        return;
+    }
+    fprintf(out, "generations: %.1f MB of table file in use\n",
+            t->arena->hdr->used / 1048576.0);
+}
+
+void ht_set_log(hash_table *t, void (*log)(void *arg, int del, key_type k, value_type v),
+        void *arg) {
+    t->log = log;
+    t->log_arg = arg;
+}
+
+uint32_t ht_version(hash_table *t, key_type k) {
+    struct ht_shard *s = &t->shards[shard_index(t, ht_hash(t, k))];
+    return atomic_load_explicit(&s->version, memory_order_acquire);
+}
+
+int ht_foreach(hash_table *t, int (*fn)(key_type k, value_type v, void *arg), void *arg) {
+    for (uint32_t i = 0; i < t->num_shards; i++) {
+        struct ht_gen *gens[2] = { t->shards[i].cur, t->shards[i].old };
+        for (int j = 0; j < 2 && gens[j]; j++) {
+            struct ht_gen *g = gens[j];
+            // Migrated slots of old are tombstones, but skip them anyway
+            uint32_t from = j ? t->shards[i].migrate_pos : 0;
+            for (uint32_t pos = from; pos < g->capacity; pos++) {
+                uint8_t m = g->meta[pos];
+                if (m && !(m & HT_DEAD) && fn(g->keys[pos], g->vals[pos], arg))
+                    return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+void ht_probe_histogram(hash_table *t, uint64_t *hist, int nbins) {
+    memset(hist, 0, nbins * sizeof(uint64_t));
+    for (uint32_t i = 0; i < t->num_shards; i++) {
+        struct ht_gen *gens[2] = { t->shards[i].cur, t->shards[i].old };
+        for (int j = 0; j < 2 && gens[j]; j++) {
+            struct ht_gen *g = gens[j];
+            // Slots of old below migrate_pos were copied to cur already
+            uint32_t from = j ? t->shards[i].migrate_pos : 0;
+            for (uint32_t pos = from; pos < g->capacity; pos++) {
+                uint8_t m = g->meta[pos];
+                int d = META_DIST(m);
+                if (m && !(m & HT_DEAD))
+                    hist[d < nbins - 1 ? d : nbins - 1]++;
+            }
+        }
+    }
+}
@@ -0,0 +1,217 @@
+#pragma once
+#include <pthread.h>
+#include "common.h"
+#include "stripe_lock.h"
+#include "arena.h"
+#include "pool.h"
+
+/* Default number of shards and of lock stripes */
+#define HT_DEFAULT_SHARDS 64
+#define HT_DEFAULT_STRIPES 64
+/* A shard is grown once it is more than HT_MAX_LOAD_NUM/HT_MAX_LOAD_DEN full */
+#define HT_MAX_LOAD_NUM 7
+#define HT_MAX_LOAD_DEN 8
+/* Probe distances are stored in the low bits of a byte - a shard is grown
+ * before one overflows */
+#define HT_MAX_DIST 126
+/* Meta bit of a deleted entry (tombstone) */
+#define HT_DEAD 0x80
+/* Smallest generation - shards never shrink below this */
+#define HT_MIN_CAPACITY 16
+
+/* Old slots moved to the new generation per operation while a shard grows */
+#define HT_MIGRATE_STEP 16
+
+/* Threads that may call into the table (ids 0 .. HT_MAX_THREADS - 1) */
+#define HT_MAX_THREADS 128
+/* Optimistic reads retried this many times before a GET takes the lock */
+#define HT_READ_RETRIES 8
+/* Default cap on memory of freed generations kept for reuse, see pool.h */
+#define HT_DEFAULT_POOL_MB 64
+
+/*
+ * One generation of a shard - an open-addressing array with linear probing
+ * and Robin Hood displacement. Keys, values and per-slot metadata live in
+ * flat arrays carved out of the same allocation as this header, so an insert
+ * never allocates unless the shard has to grow.
+ * meta[i] == 0 means slot i is empty, otherwise it is the distance of the
+ * entry in slot i from its home slot, plus one, with HT_DEAD set once the
+ * entry is deleted. A tombstone keeps its key and distance so probes still
+ * stop in the right place; an insert may take its slot where Robin Hood
+ * would have displaced it, and it is dropped when the shard is resized.
+ * capacity/mask never change for a generation, so a lock-free reader that
+ * loaded the generation pointer can trust them.
+ */
+struct ht_gen {
+    uint32_t capacity;  /* power of two */
+    uint32_t mask;      /* capacity - 1 */
+    uint32_t count;     /* occupied slots, tombstones included */
+    uint32_t dead;      /* tombstones */
+    uint8_t *meta;
+    key_type *keys;
+    value_type *vals;
+    /* Set once the generation is unlinked, see ht_online */
+    uint64_t retire_epoch;
+    struct ht_gen *next_retired;
+};
+
+/*
+ * One shard of the table, protected by lock stripe (shard index & stripe mask)
+ * A shard that passes its load factor grows incrementally: cur becomes a
+ * generation twice as large, the previous one is kept in old, and every
+ * PUT on the shard moves the next HT_MIGRATE_STEP slots of old into cur.
+ * Until old is drained a key lives in cur or in old (cur wins) - an
+ * unmigrated key is updated or deleted in place in old, and a migrated one
+ * is left behind as a tombstone, so old never changes shape and probing it
+ * stays valid.
+ * Deletes compact the same way: once a quarter of cur is tombstones, or
+ * fewer than an eighth of its slots are live, a DEL starts a resize into a
+ * generation sized for the live entries, and PUTs and DELs migrate it.
+ * GETs do not take the lock: seq is a seqlock that writers make odd while
+ * they move entries around, and readers retry if it changed under them.
+ * Overwriting a value in place or deleting an entry is a single store and
+ * leaves seq alone.
+ */
+struct __attribute__((aligned(64))) ht_shard {
+    uint32_t seq;
+    struct ht_gen *cur;
+    struct ht_gen *old;     /* NULL unless a migration is running */
+    uint32_t migrate_pos;   /* old slots below this have been moved to cur */
+    uint32_t old_left;      /* entries of old not yet moved */
+    /* Bumped after every PUT and DEL on the shard, see ht_version - kept off the
+       line readers probe through */
+    uint32_t version __attribute__((aligned(64)));
+};
+
+/* Per-thread quiescent state for reclaiming generations, one cache line each */
+struct __attribute__((aligned(64))) ht_thread {
+    uint64_t epoch;     /* global epoch when the thread last came online */
+};
+
+typedef struct {
+    struct ht_shard *shards;
+    struct stripe_set locks;
+    uint32_t num_shards;  /* power of two, never fewer than lock stripes */
+    int shard_bits;       /* the top shard_bits of the hash pick the shard, the
+                             bits below them the home slot in its generation */
+    enum HASH_KIND hash;
+
+    /* Unlinked generations wait here until no reader can still see them */
+    pthread_mutex_t retire_lock;
+    struct ht_gen *retired;
+    uint64_t epoch;
+    struct ht_thread threads[HT_MAX_THREADS];
+
+    /* Only for a table in memory - generations come from here */
+    struct pool *pool;
+    /* Only for a table kept in a file - generations are carved out of it */
+    struct arena *arena;
+    int restored;         /* the table came back from a cleanly closed file */
+
+    /* See ht_set_log */
+    void (*log)(void *arg, int del, key_type k, value_type v);
+    void *log_arg;
+} hash_table;
+
+struct ht_config {
+    uint32_t init_size;         /* initial number of slots, summed over all shards */
+    uint32_t num_shards;        /* rounded up to a power of two */
+    uint32_t num_stripes;       /* rounded up to a power of two - there are at
+                                   least as many shards as stripes */
+    enum STRIPE_KIND lock_kind;
+    enum HASH_KIND hash;
+    const char *file;           /* keep the table in this file, NULL for memory */
+    int pool_mb;                /* freed generations kept for reuse, in MB - 0 for
+                                   HT_DEFAULT_POOL_MB, negative for none */
+};
+
+/*
+ * Create a table with room for at least cfg->init_size keys before it grows
+ * With cfg->file, a file that ht_persist (or ht_destroy) closed cleanly is
+ * mapped back as it was, and only its shard headers are checked, so reopening
+ * takes the same time however many keys it holds. Any other file is emptied.
+ * Every page of a new table is written before ht_create returns, so the
+ * calling thread's CPU and memory policy decide where it lives.
+ * @return the table, or NULL if allocation failed or the file was written
+ * with a different shard count or hash (errno is EINVAL then)
+ */
+hash_table *ht_create(const struct ht_config *cfg);
+
+/* Closes the file cleanly for a file-backed table */
+void ht_destroy(hash_table *t);
+
+/*
+ * Make a file-backed table reopenable: lock out writers for good, write the
+ * shard headers and sync the file. GETs keep working, PUTs and DELs block
+ * forever - meant for shutdown. A no-op for a table in memory.
+ */
+void ht_persist(hash_table *t);
+
+/*
+ * Lock-free GETs read generations that a concurrent PUT may unlink, so
+ * memory is only reclaimed once every thread has passed a quiescent point
+ * A thread calls ht_online before using the table (this is also its
+ * quiescent point - it must not hold on to anything it read earlier) and
+ * ht_offline before it blocks for a long time, e.g. on an empty ring.
+ * Threads start offline. While online, a thread allocates and frees
+ * generations through free lists of its own.
+ */
+void ht_online(hash_table *t, int tid);
+void ht_offline(hash_table *t, int tid);
+
+/* Insert k or overwrite its value - thread-safe, caller must be online
+ * @return the value k had before, 0 if it was not in the table */
+value_type ht_put(hash_table *t, key_type k, value_type v);
+
+/* @return the value stored for k, 0 if k is not in the table - thread-safe,
+ * caller must be online */
+value_type ht_get(hash_table *t, key_type k);
+
+/* Remove k, leaving a tombstone - thread-safe, caller must be online
+ * @return 1 if k was in the table, 0 otherwise - its value goes to *old
+ * then, unless old is NULL */
+int ht_del(hash_table *t, key_type k, value_type *old);
+
+/*
+ * Have ht_put and ht_del call log(arg, del, k, v) for every change they make,
+ * once it is in place and while k's stripe is still locked - so a log written
+ * from there has the changes to one key in the order they were made. A DEL
+ * of a key that is not in the table is no change. Not thread-safe - set it
+ * before other threads use the table, log NULL turns it off.
+ */
+void ht_set_log(hash_table *t, void (*log)(void *arg, int del, key_type k, value_type v),
+        void *arg);
+
+/*
+ * Versions let a caller keep GET results around: ht_get_versioned also
+ * returns the version of k's shard as it was before the lookup, and the
+ * result is still current for as long as ht_version(t, k) returns the same
+ * number. Any completed PUT to the shard changes it.
+ */
+value_type ht_get_versioned(hash_table *t, key_type k, uint32_t *version);
+uint32_t ht_version(hash_table *t, key_type k);
+
+/*
+ * Block every PUT and DEL until ht_unlock_all - GETs carry on. Makes the
+ * table stand still for a moment, e.g. for a consistent fork
+ */
+void ht_lock_all(hash_table *t);
+void ht_unlock_all(hash_table *t);
+
+/*
+ * Call fn for every key and its value, in no particular order, stopping
+ * early if fn returns non-zero
+ * Does not lock, so only call it on a table nobody is writing to
+ * @return 0 if every entry was visited, -1 if fn stopped it
+ */
+int ht_foreach(hash_table *t, int (*fn)(key_type k, value_type v, void *arg), void *arg);
+
+/* How much memory the generations take, and how much of it is recycled */
+void ht_alloc_report(hash_table *t, FILE *out);
+
+/*
+ * Count entries by probe distance (distance from their home slot) - hist[d]
+ * for d < nbins - 1, everything further in hist[nbins - 1]
+ * Walks every shard without locking, so only call it on a quiet table
+ */
+void ht_probe_histogram(hash_table *t, uint64_t *hist, int nbins);
@@ -0,0 +1,259 @@
+/*
+ * Compares the hash functions in common.h on the key streams our workloads
+ * produce: sequential keys in shuffled order (gen_workload.py with skew <= 1)
+ * and zipf-distributed keys (skew > 1) - and on strided keys that differ only
+ * in their high bits, which must still spread over every shard
+ * Exits with failure if they do not
+ * For each hash it reports the bucket-length distribution of a chained
+ * power-of-two table, and the throughput and probe distances of hash_table.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "common.h"
+#include "hash_table.h"
+#include "zipf.h"
+
+/* Bucket lengths 0 .. LEN_BINS - 2 are reported individually, the rest summed */
+#define LEN_BINS 9
+#define PROBE_BINS 9
+/* Largest shard allowed for strided keys, in multiples of an even share */
+#define MAX_IMBALANCE 8
+
+uint32_t num_keys = 1000000;
+double skew = 1.2;
+uint64_t seed = 1;
+uint32_t init_size = 1024;
+
+/* Return the elapsed time between two timespecs in ns. */
+double get_elapsed_ns(struct timespec *start, struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Fill keys with 1..n in random order, like gen_workload.py's uniform mode
+*/
+void gen_uniform(key_type *keys, uint32_t n, struct rng *r) {
+	for (uint32_t i = 0; i < n; i++)
+		keys[i] = i + 1;
+	for (uint32_t i = n - 1; i > 0; i--) {
+		uint32_t j = rng_below(r, i + 1);
+		key_type tmp = keys[i];
+		keys[i] = keys[j];
+		keys[j] = tmp;
+	}
+}
+
+/*
+ * Fill keys with 1..n times the largest power of two that keeps them in 32
+ * bits, in random order - only the high bits differ
+*/
+void gen_strided(key_type *keys, uint32_t n, struct rng *r) {
+	int shift = 32 - (32 - __builtin_clz(n));
+	gen_uniform(keys, n, r);
+	for (uint32_t i = 0; i < n; i++)
+		keys[i] <<= shift;
+}
+
+void gen_zipf(key_type *keys, uint32_t n, struct rng *r) {
+	struct zipf z;
+	zipf_init(&z, UINT32_MAX, skew);
+	for (uint32_t i = 0; i < n; i++)
+		keys[i] = zipf_next(&z, r);
+}
+
+/*
+ * Bucket lengths of a chained table with one bucket per distinct key
+ * (rounded up to a power of two) - the shape the old kv_store had
+*/
+void chained_report(enum HASH_KIND kind, key_type *keys, uint32_t n, uint32_t distinct) {
+	uint32_t buckets = 2;
+	while (buckets < distinct)
+		buckets <<= 1;
+
+	/* Only count each distinct key once - first occurrence wins */
+	uint32_t *len = calloc(buckets, sizeof(uint32_t));
+	hash_table *seen;
+	struct ht_config cfg = { .init_size = distinct, .num_shards = 1, .num_stripes = 1,
+		.lock_kind = STRIPE_SPIN, .hash = HASH_MURMUR3 };
+	if (len == NULL || (seen = ht_create(&cfg)) == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	ht_online(seen, 0);
+	for (uint32_t i = 0; i < n; i++) {
+		if (ht_get(seen, keys[i]))
+			continue;
+		ht_put(seen, keys[i], 1);
+		/* Indexed from the top bits, like hash_table.c */
+		len[hash_top(kind, keys[i]) >> __builtin_clz(buckets - 1)]++;
+	}
+	ht_destroy(seen);
+
+	uint64_t hist[LEN_BINS] = { 0 };
+	uint32_t max = 0;
+	for (uint32_t b = 0; b < buckets; b++) {
+		hist[len[b] < LEN_BINS - 1 ? len[b] : LEN_BINS - 1]++;
+		if (len[b] > max)
+			max = len[b];
+	}
+	free(len);
+
+	printf("  chained %u buckets: max %u, by length:", buckets, max);
+	for (int i = 0; i < LEN_BINS; i++)
+		printf(" %s%d=%.1f%%", i == LEN_BINS - 1 ? ">=" : "", i, 100.0 * hist[i] / buckets);
+	printf("\n");
+}
+
+/*
+ * PUT every key, then GET every key, through hash_table.c
+ * @return number of distinct keys, the capacity of the largest shard in *largest
+*/
+uint32_t table_report(enum HASH_KIND kind, key_type *keys, uint32_t n, uint32_t *largest) {
+	struct timespec s, m, e;
+	struct ht_config cfg = { .init_size = init_size, .num_shards = HT_DEFAULT_SHARDS,
+		.num_stripes = HT_DEFAULT_STRIPES, .lock_kind = STRIPE_MUTEX, .hash = kind };
+	hash_table *t = ht_create(&cfg);
+	if (t == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	ht_online(t, 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	for (uint32_t i = 0; i < n; i++) {
+		ht_put(t, keys[i], i + 1);
+		/* A quiescent point now and then, like a server thread between
+		 * batches - lets grown-out-of generations be recycled */
+		if ((i & 1023) == 1023)
+			ht_online(t, 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &m);
+	value_type sum = 0;
+	for (uint32_t i = 0; i < n; i++)
+		sum += ht_get(t, keys[i]);
+	clock_gettime(CLOCK_MONOTONIC, &e);
+
+	uint64_t hist[PROBE_BINS];
+	uint64_t distinct = 0, total = 0;
+	ht_probe_histogram(t, hist, PROBE_BINS);
+	for (int i = 0; i < PROBE_BINS; i++) {
+		distinct += hist[i];
+		total += hist[i] * i;
+	}
+	*largest = 0;
+	for (uint32_t i = 0; i < t->num_shards; i++)
+		if (t->shards[i].cur->capacity > *largest)
+			*largest = t->shards[i].cur->capacity;
+	printf("  ");
+	ht_alloc_report(t, stdout);
+	printf("  largest of %u shards: %u slots\n", t->num_shards, *largest);
+	ht_destroy(t);
+
+	printf("  table: put %.2f M/s, get %.2f M/s (checksum %u), mean probe %.2f, by distance:",
+			n * 1e3 / get_elapsed_ns(&s, &m), n * 1e3 / get_elapsed_ns(&m, &e), sum,
+			distinct ? (double)total / distinct : 0.0);
+	for (int i = 0; i < PROBE_BINS; i++)
+		printf(" %s%d=%.1f%%", i == PROBE_BINS - 1 ? ">=" : "", i,
+				distinct ? 100.0 * hist[i] / distinct : 0.0);
+	printf("\n");
+	return distinct;
+}
+
+/*
+ * Report every hash on keys - with from > 0, skip the first hashes
+ * @return the largest shard any hash grew, relative to an even share
+*/
+double run(const char *name, key_type *keys, uint32_t n, int from) {
+	double worst = 0;
+	printf("%s keys (%u requests)\n", name, n);
+	for (int kind = from; kind < NUM_HASH_KINDS; kind++) {
+		uint32_t largest;
+		printf(" %s\n", hash_name(kind));
+		uint32_t distinct = table_report(kind, keys, n, &largest);
+		chained_report(kind, keys, n, distinct);
+		/* A shard at 50-100% load holds up to twice its share */
+		double share = 2.0 * distinct / HT_DEFAULT_SHARDS;
+		if (largest / share > worst)
+			worst = largest / share;
+	}
+	return worst;
+}
+
+void usage(char *name) {
+	printf("Usage: %s [-h] [-n num_keys] [-z skew] [-i init_table_size] [-S seed]\n", name);
+	printf("-h show this help\n");
+	printf("-n number of keys in each run (default: 1000000)\n");
+	printf("-z zipf exponent for the skewed run (default: 1.2)\n");
+	printf("-i initial size of the hash_table.c table, so growth is part of the run (default: 1024)\n");
+	printf("-S random seed (default: 1)\n");
+}
+
+static int parse_args(int argc, char **argv) {
+	int op;
+	while ((op = getopt(argc, argv, "hn:z:i:S:")) != -1) {
+		switch (op) {
+		case 'h':
+		usage(argv[0]);
+		exit(EXIT_SUCCESS);
+		break;
+
+		case 'n':
+		num_keys = atoi(optarg);
+		break;
+
+		case 'z':
+		skew = atof(optarg);
+		break;
+
+		case 'i':
+		init_size = atoi(optarg);
+		break;
+
+		case 'S':
+		seed = strtoull(optarg, NULL, 0);
+		break;
+
+		default:
+		usage(argv[0]);
+		return 1;
+		}
+	}
+	if (num_keys < 2 || skew <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	if (parse_args(argc, argv) != 0)
+		exit(EXIT_FAILURE);
+
+	key_type *keys = malloc(num_keys * sizeof(key_type));
+	if (keys == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	struct rng r;
+	rng_seed(&r, seed);
+	gen_uniform(keys, num_keys, &r);
+	run("uniform", keys, num_keys, 0);
+	gen_zipf(keys, num_keys, &r);
+	run("zipf", keys, num_keys, 0);
+	/* mod leaves strided keys where they are, by design - only the others
+	 * have to spread them */
+	gen_strided(keys, num_keys, &r);
+	double worst = run("strided", keys, num_keys, HASH_MOD + 1);
+
+	free(keys);
+	if (worst > MAX_IMBALANCE) {
+		printf("strided keys grew a shard to %.1fx its share\n", worst);
+		return 1;
+	}
+	return 0;
+}
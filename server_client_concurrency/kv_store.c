@@ -1,101 +1,434 @@
+#define _GNU_SOURCE
 #include "common.h"
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include "ring_buffer.h"
+#include "hash_table.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "slab.h"
+#include "affinity.h"
+#include "stats.h"
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdatomic.h>
 #include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/wait.h>
 
 #define MAX_THREADS 128
+#define MAX_BATCH 256
+#define MAX_CACHE_SLOTS (1 << 16)
 char shm_file[] = "shmem_file";
 char *shmem_area = NULL;
+size_t shmem_size; /* bytes of the shared region */
 struct ring *ring = NULL;
+struct slab *slab = NULL; /* values live here if the client set up a value area */
+uint64_t slab_bytes; /* ... and this much of the region is mapped for it */
+struct stats_region *stats = NULL; /* what we count, for kvstat to read */
 pthread_t threads[MAX_THREADS];
 int num_threads = 1;
 uint32_t table_size = 1024;
+int batch_size = 32; /* max descriptors taken per ring_get_batch */
+int num_stripes = HT_DEFAULT_STRIPES;
+enum STRIPE_KIND lock_kind = STRIPE_MUTEX;
+enum HASH_KIND hash_kind = HASH_FIBONACCI;
+int report = 0; /* print statistics on SIGUSR1 and at exit */
+uint32_t cache_slots = 1024; /* per-thread GET cache, 0 turns it off */
+int pool_mb = HT_DEFAULT_POOL_MB; /* freed generations kept for reuse */
+char *table_file = NULL; /* keep the table in this file, see ht_persist */
+char *wal_file = NULL; /* log PUTs and DELs here, see wal.h */
+enum WAL_SYNC wal_sync = WAL_SYNC_GROUP;
+int wal_period_ms = WAL_DEFAULT_PERIOD_MS;
+struct wal wal;
+char *snapshot_file = NULL; /* loaded at startup, written by take_snapshot */
+int snapshot_interval = 0; /* seconds between snapshots, 0 for SIGUSR2 only */
+pid_t snapshot_pid = -1; /* child writing the current snapshot */
+uint64_t snapshots_taken, snapshots_failed;
+uint64_t snapshot_pause_ns; /* how long writers waited for the last fork */
+struct affinity placement; /* -C: where the worker threads run */
+char *mem_policy = NULL; /* -N: where the table's pages go */
 int verbose;
 
 #define PRINTV(...) if (verbose) printf("Server: "); if (verbose) printf(__VA_ARGS__)
 
+/*
+ * Front cache for hot keys - direct mapped, private to a server thread
+ * An entry holds the shard version it was read under and is only used
+ * while the shard still has that version, so a PUT or DEL from any thread
+ * invalidates it without touching the cache
+ */
+struct cache_entry {
+    key_type k;
+    value_type v;
+    uint32_t version;
+    uint32_t used;
+};
+
 struct thread_context {
     int tid;
+    struct cache_entry *cache;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
 };
+struct thread_context contexts[MAX_THREADS];
 
-typedef struct pair{
-    key_type k;
-    value_type v;
-    struct pair *next;
-} kv_pair;
+hash_table *table;
 
-typedef struct {
-    kv_pair *pairs;
-    int size;
-} kv_list;
+/* With a value area the table holds the reference to each block, and a
+ * block it no longer holds is dropped
+ * With a log, the table logs each change itself - see log_change */
+void put(key_type k, value_type v) {
+    value_type old = ht_put(table, k, v);
+    if (slab && old)
+        slab_put(slab, old);
+}
 
+int del(key_type k) {
+    value_type old = 0;
+    int found = ht_del(table, k, &old);
+    if (slab && old)
+        slab_put(slab, old);
+    return found;
+}
 
-typedef struct {
-    kv_list *entries;
-    pthread_mutex_t *mutex;
-    int num_locks;
-} hash_table;
+/* Called by the table with the key's stripe still locked, see ht_set_log */
+void log_change(void *arg, int deleted, key_type k, value_type v) {
+    wal_add(arg, deleted ? DEL : PUT, k, v);
+}
 
-hash_table *table;
+/* Redo a logged mutation at startup */
+void replay(const struct wal_record *rec) {
+    if (rec->type == DEL)
+        ht_del(table, rec->k, NULL);
+    else
+        ht_put(table, rec->k, rec->v);
+}
 
-void put(key_type k, value_type v) {
-    int index = hash_function(k, table_size);
-    pthread_mutex_lock(&table->mutex[index / table->num_locks]);
-    for (int i = 0; i < table->entries[index].size; i++) {
-        if (table->entries[index].pairs[i].k == k) {
-            table->entries[index].pairs[i].v = v;
-	    pthread_mutex_unlock(&table->mutex[index / table->num_locks]);
-	    return;
+/*
+ * k's block, with a reference for the client
+ * A PUT may replace and free the block as soon as we have read its handle,
+ * and the block may be handed out again - so the reference only counts if
+ * k's shard did not change while we took it
+ */
+value_type get_block(key_type k) {
+    uint32_t version;
+    value_type h;
+    while ((h = ht_get_versioned(table, k, &version)) != 0) {
+        if (!slab_tryget(slab, h))
+            continue;
+        if (ht_version(table, k) == version)
+            break;
+        slab_put(slab, h);
+    }
+    return h;
+}
+
+value_type get(struct thread_context *ctx, key_type k) {
+    // A cached handle would need the same dance, so blocks skip the cache
+    if (slab)
+        return get_block(k);
+    if (!ctx->cache)
+        return ht_get(table, k);
+    // Middle bits of the product - with -H fib the table picks the shard
+    // from its top bits, so a cache index made of those would only repeat it
+    struct cache_entry *e = &ctx->cache[(hash_fibonacci(k) >> 16) & (cache_slots - 1)];
+    if (e->used && e->k == k && e->version == ht_version(table, k)) {
+        ctx->cache_hits++;
+        return e->v;
+    }
+    ctx->cache_misses++;
+    e->k = k;
+    e->v = ht_get_versioned(table, k, &e->version);
+    e->used = 1;
+    return e->v;
+}
+
+/*
+ * Print everything the server counts - called from the signal thread
+ */
+void print_report(FILE *out) {
+    char where[256];
+    affinity_describe(&placement, num_threads, where, sizeof(where));
+    fprintf(out, "placement: %s, memory policy %s\n", where, mem_policy ? mem_policy : "local");
+    stripes_report(&table->locks, out);
+    ht_alloc_report(table, out);
+    if (wal_file)
+        wal_report(&wal, out);
+    if (slab)
+        slab_report(slab, out);
+    if (snapshot_file)
+        fprintf(out, "snapshots: %" PRIu64 " taken, %" PRIu64 " failed, last fork paused writers for %.1f us\n",
+                snapshots_taken, snapshots_failed, snapshot_pause_ns / 1e3);
+    if (cache_slots) {
+        uint64_t hits = 0, misses = 0;
+        for (int i = 0; i < num_threads; i++) {
+            hits += contexts[i].cache_hits;
+            misses += contexts[i].cache_misses;
         }
+        fprintf(out, "get cache: %u slots/thread, %" PRIu64 " hits, %" PRIu64 " misses (%.1f%% hit)\n",
+                cache_slots, hits, misses,
+                hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+    }
+    if (stats) {
+        static const char *names[STATS_NUM_OPS][2] = {
+            { "put queue", "put exec" }, { "get queue", "get exec" } };
+        for (int op = 0; op < STATS_NUM_OPS; op++) {
+            struct lat_hist queue = { 0 }, exec = { 0 };
+            for (int i = 0; i < num_threads; i++) {
+                hist_merge(&queue, &stats->threads[i].queue[op], 1);
+                hist_merge(&exec, &stats->threads[i].exec[op], 1);
+            }
+            hist_print(&queue, names[op][0], out);
+            hist_print(&exec, names[op][1], out);
+        }
+    }
+    fflush(out);
+}
+
+/* Collect the snapshot child if it has finished - or once it has, if wait is set */
+void reap_snapshot(int wait) {
+    int status;
+    if (snapshot_pid <= 0 || waitpid(snapshot_pid, &status, wait ? 0 : WNOHANG) <= 0)
+        return;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("snapshot to %s failed\n", snapshot_file);
+        snapshots_failed++;
+    }
+    snapshot_pid = -1;
+}
+
+/*
+ * Fork a child that writes the table out from its copy-on-write view of it
+ * Writers are held off only while fork copies the page tables, so that no
+ * shard is caught halfway through a PUT - GETs never wait
+ */
+void take_snapshot(void) {
+    struct timespec start, end;
+    pid_t pid;
+
+    reap_snapshot(0);
+    if (snapshot_pid > 0) {
+        PRINTV("previous snapshot still running, skipping\n");
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ht_lock_all(table);
+    // Every change in the table is in the log by now, and no other gets there
+    uint64_t offset = wal_file ? wal_offset(&wal) : 0;
+    if ((pid = fork()) == 0)
+        _exit(snapshot_write(table, snapshot_file, offset) ? 1 : 0);
+    ht_unlock_all(table);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    snapshot_pause_ns = (end.tv_sec - start.tv_sec) * 1000000000ull + end.tv_nsec - start.tv_nsec;
+    if (pid < 0) {
+        perror("fork");
+        snapshots_failed++;
+        return;
     }
+    snapshot_pid = pid;
+    snapshots_taken++;
+}
+
+/* Next signal in set - @return -1 if snapshot_interval passed first */
+int next_signal(sigset_t *set, struct timespec *deadline) {
+    struct timespec now, left;
+    int sig;
 
-    // Key not found, insert new key-value pair
-    table->entries[index].pairs = realloc(table->entries[index].pairs, (table->entries[index].size + 1) * sizeof(kv_pair));
-    table->entries[index].pairs[table->entries[index].size].k = k;
-    table->entries[index].pairs[table->entries[index].size].v = v;
-    //atomic_fetch_add(&table->size, 1);
-    atomic_fetch_add(&table->entries[index].size, 1);
-    pthread_mutex_unlock(&table->mutex[index / table->num_locks]);
+    if (!snapshot_interval)
+        return sigwait(set, &sig) ? 0 : sig;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left.tv_sec = deadline->tv_sec - now.tv_sec;
+    left.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (left.tv_nsec < 0) {
+        left.tv_sec--;
+        left.tv_nsec += 1000000000;
+    }
+    if (left.tv_sec >= 0 && (sig = sigtimedwait(set, NULL, &left)) >= 0)
+        return sig;
+    if (left.tv_sec >= 0 && errno != EAGAIN)
+        return 0;
+    deadline->tv_sec = now.tv_sec + snapshot_interval;
+    deadline->tv_nsec = now.tv_nsec;
+    return -1;
 }
 
-value_type get(key_type k) {
-    int index = hash_function(k, table_size);
-    pthread_mutex_lock(&table->mutex[index / table->num_locks]);
-    for (int i = 0; i < table->entries[index].size; i++) {
-        if (table->entries[index].pairs[i].k == k) {
-	  value_type v = table->entries[index].pairs[i].v;
-	 pthread_mutex_unlock(&table->mutex[index / table->num_locks]);
-	  return v;
+/*
+ * Waits for SIGUSR1 (report), SIGUSR2 (snapshot) and SIGTERM/SIGINT (report
+ * and exit), and takes a snapshot every snapshot_interval seconds
+ * Every other thread blocks these, so the report is printed from a normal
+ * thread context rather than from a signal handler
+ */
+void *signal_function(void *arg) {
+    sigset_t *set = arg;
+    struct timespec deadline;
+    int sig;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += snapshot_interval;
+    while (1) {
+        if ((sig = next_signal(set, &deadline)) == 0)
+            continue;
+        reap_snapshot(0);
+        if (sig < 0 || sig == SIGUSR2) {
+            if (snapshot_file)
+                take_snapshot();
+            continue;
         }
+        if (sig != SIGUSR1 && wal_file)
+            wal_flush(&wal);
+        // A last snapshot, so a restart finds everything without the log
+        if (sig != SIGUSR1 && snapshot_file) {
+            reap_snapshot(1);
+            take_snapshot();
+            reap_snapshot(1);
+        }
+        if (report)
+            print_report(stdout);
+        if (sig == SIGUSR1)
+            continue;
+        // The log is kept even so - once the server runs again the file is
+        // dirty until the next clean shutdown, and only the log can rebuild it
+        if (table_file)
+            ht_persist(table);
+        exit(0);
     }
-    pthread_mutex_unlock(&table->mutex[index / table->num_locks]);
-    return 0;
+    return NULL;
+}
+
+/*
+ * Count a request that was sent at sent (0 if the client did not say), taken
+ * up at start and done at end - a vector of ops is one latency sample
+ */
+static void count_request(struct thread_stats *st, int op, uint64_t ops,
+        uint64_t sent, uint64_t start, uint64_t end) {
+    STAT_ADD(st->ops[op], ops);
+    STAT_ADD(st->requests, 1);
+    STAT_ADD(st->busy_ns, end - start);
+    hist_add(&st->exec[op], end - start);
+    if (sent && sent < start)
+        hist_add(&st->queue[op], start - sent);
+}
+
+/* A value the client hands over - with a value area, a handle we are about
+ * to keep, read through and eventually free */
+static int value_ok(value_type v) {
+    return !slab || v == 0 || slab_valid(slab, slab_bytes, v);
+}
+
+/* The client works out the offsets in a descriptor - they must point inside
+ * the region before we write there, and the values it puts inside the value
+ * area */
+static int desc_ok(const struct buffer_descriptor *bd) {
+    int vector = bd->req_type == MPUT || bd->req_type == MGET;
+    if (!(bd->res_off >= 0 &&
+            (size_t)bd->res_off + sizeof(struct buffer_descriptor) <= shmem_size &&
+            bd->db_off >= 0 &&
+            (size_t)bd->db_off + sizeof(struct completion_doorbell) <= shmem_size &&
+            (!vector || (bd->vec_off >= 0 && bd->vec_len >= 0 && bd->vec_len <= MAX_VEC &&
+                         (size_t)bd->vec_off + bd->vec_len * sizeof(struct kv_pair) <= shmem_size))))
+        return 0;
+    if (bd->req_type == PUT)
+        return value_ok(bd->v);
+    if (bd->req_type == MPUT) {
+        struct kv_pair *vec = (struct kv_pair *)(shmem_area + bd->vec_off);
+        for (int j = 0; j < bd->vec_len; j++)
+            if (!value_ok(vec[j].v))
+                return 0;
+    }
+    return 1;
 }
 
 void *thread_function(void *arg) {
-    struct buffer_descriptor bd;
+    struct thread_context *ctx = arg;
+    struct buffer_descriptor bds[MAX_BATCH];
     struct buffer_descriptor *result;
+    struct sq_poller poller = { .tid = ctx->tid, .nthreads = num_threads, .next = 0 };
+    struct thread_stats *st = stats ? &stats->threads[ctx->tid] : NULL;
+    // One clock read per request - each one ends the last and starts the next
+    uint64_t now = st ? stats_now() : 0;
+    if (affinity_pin(&placement, ctx->tid))
+        perror("pthread_setaffinity_np");
     while (1) {
-      //      struct buffer_descriptor *bd = malloc(sizeof(struct buffer_descriptor));
-      //  struct buffer_descriptor *result;
-      ring_get(ring, &bd);
-        result = (struct buffer_descriptor *)(shmem_area + bd.res_off);
-        memcpy(result, &bd, sizeof(struct buffer_descriptor));
-        if (result->req_type == PUT) {
-            put(result->k, result->v);
+        int n;
+        // Waiting for work may take a while - don't hold up reclamation
+        // of hash table memory meanwhile
+        ht_offline(table, ctx->tid);
+        if (ring->num_sq) {
+            // More server threads than client queues - nothing to poll
+            if ((n = sq_get_batch(ring, &poller, bds, batch_size)) == 0)
+                break;
+        } else {
+            n = ring_get_batch(ring, bds, batch_size);
+        }
+        ht_online(table, ctx->tid);
+        if (st) {
+            uint64_t waited = now;
+            now = stats_now();
+            STAT_ADD(st->idle_ns, now - waited);
+            STAT_ADD(st->batches, 1);
+        }
+        for (int i = 0; i < n; i++) {
+            if (!desc_ok(&bds[i])) {
+                printf("dropping a request that points outside the shared region or value area\n");
+                continue;
+            }
+            result = (struct buffer_descriptor *)(shmem_area + bds[i].res_off);
+            memcpy(result, &bds[i], sizeof(struct buffer_descriptor));
+            struct completion_doorbell *db =
+                (struct completion_doorbell *)(shmem_area + bds[i].db_off);
+            // Mutations are logged, and acknowledged when the log says so
+            int logged = wal_file && result->req_type != GET && result->req_type != MGET;
+            if (result->req_type == PUT) {
+                put(result->k, result->v);
+            }
+            else if (result->req_type == DEL) {
+                // Tell the client whether there was anything to delete
+                result->v = del(result->k);
+            }
+            else if (result->req_type == MPUT) {
+                struct kv_pair *vec = (struct kv_pair *)(shmem_area + result->vec_off);
+                for (int j = 0; j < result->vec_len; j++) {
+                    // desc_ok checked the vector, but the client can still
+                    // write it - check the value we actually keep again
+                    struct kv_pair pair = vec[j];
+                    if (value_ok(pair.v))
+                        put(pair.k, pair.v);
+                }
+            }
+            else if (result->req_type == MGET) {
+                struct kv_pair *vec = (struct kv_pair *)(shmem_area + result->vec_off);
+                for (int j = 0; j < result->vec_len; j++)
+                    vec[j].v = get(ctx, vec[j].k);
+            }
+            else {
+                result->v = get(ctx, result->k);
+                result->val_len = slab && result->v ? slab_block(slab, result->v)->len : 0;
+            }
+            if (logged)
+                wal_commit(&wal, result, db);
+            else
+                ring_complete(ring, result, db);
+            if (st) {
+                uint64_t start = now;
+                int vector = bds[i].req_type == MPUT || bds[i].req_type == MGET;
+                now = stats_now();
+                count_request(st, bds[i].req_type == GET || bds[i].req_type == MGET ?
+                        STATS_GET : STATS_PUT, vector ? bds[i].vec_len : 1,
+                        bds[i].sent_ns, start, now);
+            }
         }
-        else {
-            result->v = get(result->k);
+        // The ring and the stripe locks count these for the calling thread
+        if (st) {
+            atomic_store_explicit(&st->empty_waits, ring_empty_waits, memory_order_relaxed);
+            atomic_store_explicit(&st->lock_waits, stripe_waits, memory_order_relaxed);
         }
-        result->ready = 1;
-	//        free(bd);
     }
 
     return NULL;
@@ -103,7 +436,7 @@ void *thread_function(void *arg) {
 
 static int parse_args(int argc, char **argv) {
     int op;
-    while ((op = getopt(argc, argv, "n:t:s:v")) != -1) {
+    while ((op = getopt(argc, argv, "n:t:s:vb:l:k:rH:c:W:F:P:T:S:I:M:C:N:")) != -1) {
         switch (op) {
         case 'n':
             num_threads = atoi(optarg);
@@ -117,11 +450,118 @@ static int parse_args(int argc, char **argv) {
         case 's':
             table_size = atoi(optarg);
             break;
+        case 'b':
+            batch_size = atoi(optarg);
+            if (batch_size < 1 || batch_size > MAX_BATCH) {
+                printf("batch size must be in [1, %d]\n", MAX_BATCH);
+                return 1;
+            }
+            break;
+        case 'l':
+            num_stripes = atoi(optarg);
+            if (num_stripes < 1) {
+                printf("need at least one lock stripe\n");
+                return 1;
+            }
+            break;
+        case 'k':
+            if (!strcmp(optarg, "mutex")) {
+                lock_kind = STRIPE_MUTEX;
+            } else if (!strcmp(optarg, "spin")) {
+                lock_kind = STRIPE_SPIN;
+            } else {
+                printf("lock kind must be mutex or spin\n");
+                return 1;
+            }
+            break;
+        case 'r':
+            report = 1;
+            break;
+        case 'H': {
+            int kind = hash_parse(optarg);
+            if (kind < 0) {
+                printf("hash must be mod, fib or murmur3\n");
+                return 1;
+            }
+            hash_kind = kind;
+            break;
+        }
+        case 'c':
+            cache_slots = atoi(optarg);
+            if (cache_slots > MAX_CACHE_SLOTS || (cache_slots & (cache_slots - 1))) {
+                printf("cache slots must be 0 or a power of two up to %d\n", MAX_CACHE_SLOTS);
+                return 1;
+            }
+            break;
+        case 'T':
+            table_file = optarg;
+            break;
+        case 'M':
+            // 0 keeps nothing - the table treats 0 as "default"
+            pool_mb = atoi(optarg);
+            if (pool_mb < 0) {
+                printf("pool size must be at least 0 MB\n");
+                return 1;
+            }
+            if (pool_mb == 0)
+                pool_mb = -1;
+            break;
+        case 'S':
+            snapshot_file = optarg;
+            break;
+        case 'I':
+            snapshot_interval = atoi(optarg);
+            if (snapshot_interval < 1) {
+                printf("snapshot interval must be at least 1 second\n");
+                return 1;
+            }
+            break;
+        case 'C':
+            if (affinity_parse(&placement, optarg) < 0) {
+                printf("cpus must be compact, scatter or a list of allowed cpus like 0-3,8\n");
+                return 1;
+            }
+            break;
+        case 'N':
+            mem_policy = optarg;
+            if (affinity_mempolicy(mem_policy) < 0) {
+                printf("memory policy must be local, interleave or a node number\n");
+                return 1;
+            }
+            break;
+        case 'W':
+            wal_file = optarg;
+            break;
+        case 'F': {
+            int sync = wal_parse_sync(optarg);
+            if (sync < 0) {
+                printf("sync policy must be none, periodic, group or always\n");
+                return 1;
+            }
+            wal_sync = sync;
+            break;
+        }
+        case 'P':
+            wal_period_ms = atoi(optarg);
+            if (wal_period_ms < 1) {
+                printf("sync period must be at least 1 ms\n");
+                return 1;
+            }
+            break;
         default:
             printf("failed getting arg in main %c\n", op);
             return 1;
         }
     }
+    // A forked child shares a file mapping instead of getting a private copy
+    if (snapshot_file && table_file) {
+        printf("snapshots need the table in memory - -S and -T do not mix\n");
+        return 1;
+    }
+    if (snapshot_interval && !snapshot_file) {
+        printf("-I needs a snapshot file (-S)\n");
+        return 1;
+    }
 
     return 0;
 }
@@ -130,34 +570,11 @@ int main(int argc, char *argv[]) {
     if (parse_args(argc, argv) != 0) {
 		exit(1);
     }
-
-    // Allocate space for hash table struct.
-    table = malloc(sizeof(hash_table));
-    if (table == NULL) {
-        exit(1);
-    }
-    // Allocate (zero'd) space for entry buckets.
-    table->entries = calloc(table_size, sizeof(kv_list));
-    if (table->entries == NULL) {
-        free(table); // error, free table before we return!
-        perror("error");
+    if (num_threads > HT_MAX_THREADS) {
+        printf("at most %d server threads\n", HT_MAX_THREADS);
         exit(1);
     }
 
-    for (int i = 0; i < table_size; i++) {
-      table->entries[i].size = 0;
-      table->entries[i].pairs = NULL;
-    }
-    
-    table->num_locks = (table_size/100)+1;
-    table->mutex = calloc(table->num_locks, sizeof(pthread_mutex_t));
-    if (table->mutex == NULL) {
-        free(table); // error, free table before we return!
-        perror("error");
-        exit(1);
-
-    }
-    
     struct stat file_info;
     int fd = open(shm_file, O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
     if (fd < 0) {
@@ -168,19 +585,150 @@ int main(int argc, char *argv[]) {
         perror("open");
     }
     // points to the beginning of the shared memory region
-    shmem_area = mmap(NULL, file_info.st_size - 1, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+    shmem_size = file_info.st_size;
+    shmem_area = mmap(NULL, shmem_size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
     if (shmem_area == (void *)-1) {
         perror("mmap");
     }
     /* mmap dups the fd, no longer needed */
     close(fd);
     ring = (struct ring *)shmem_area;
+    // The client picked the ring geometry - make sure it fits what we mapped
+    if (ring->capacity == 0 || (ring->capacity & ring->mask) ||
+            ring_bytes(ring->capacity) > (size_t)file_info.st_size) {
+        printf("shared region does not hold a valid ring\n");
+        exit(1);
+    }
+    if (ring->num_sq && (ring->num_sq > MAX_SQ || ring->sq_off % 64 ||
+                ring->sq_off < ring_bytes(ring->capacity) ||
+                ring->sq_off + ring->num_sq * sq_ring_bytes(ring->capacity) > shmem_size)) {
+        printf("submission queues do not fit in the shared region\n");
+        exit(1);
+    }
+    PRINTV("ring capacity %u, %u submission queues\n", ring->capacity, ring->num_sq);
+    if (ring->slab_off) {
+        slab = (struct slab *)(shmem_area + ring->slab_off);
+        slab_bytes = file_info.st_size - ring->slab_off;
+        if (ring->slab_off % 64 || ring->slab_off >= file_info.st_size ||
+                slab_check(slab, slab_bytes)) {
+            printf("shared region does not hold a valid value area\n");
+            exit(1);
+        }
+        // Handles mean nothing once the client is gone
+        if (wal_file || snapshot_file || table_file) {
+            printf("values in shared memory cannot be logged or saved - no -W, -S or -T\n");
+            exit(1);
+        }
+        cache_slots = 0;
+        PRINTV("values in a %u byte area\n", slab->size);
+    }
+    if (ring->stats_off) {
+        if (ring->stats_off % 64 ||
+                ring->stats_off + sizeof(struct stats_region) > (size_t)file_info.st_size) {
+            printf("shared region does not hold a valid stats area\n");
+            exit(1);
+        }
+        stats = (struct stats_region *)(shmem_area + ring->stats_off);
+        memset(stats, 0, sizeof(struct stats_region));
+        stats->num_threads = num_threads;
+        stats->start_ns = stats_now();
+        // kvstat reads nothing until the magic says the rest is set
+        atomic_store_explicit(&stats->magic, STATS_MAGIC, memory_order_release);
+    }
+
+    // The first worker's CPU first touches the initial table, so it starts
+    // out on the workers' node
+    affinity_pin(&placement, 0);
+
+    // Size the table for the snapshot up front, so loading it never grows a shard
+    uint64_t snapshot_keys = 0, snapshot_wal_offset = 0;
+    if (snapshot_file && snapshot_count(snapshot_file, &snapshot_keys, &snapshot_wal_offset) != 0 &&
+            errno != ENOENT) {
+        // Rather than overwrite it with the next snapshot
+        perror(snapshot_file);
+        exit(1);
+    }
+    if (snapshot_keys * 2 > table_size)
+        table_size = snapshot_keys * 2 < UINT32_MAX ? snapshot_keys * 2 : UINT32_MAX;
+
+    struct ht_config cfg = {
+        .init_size = table_size,
+        .num_shards = HT_DEFAULT_SHARDS,
+        .num_stripes = num_stripes,
+        .lock_kind = lock_kind,
+        .hash = hash_kind,
+        .file = table_file,
+        .pool_mb = pool_mb,
+    };
+    table = ht_create(&cfg);
+    if (table == NULL) {
+        perror("error");
+        exit(1);
+    }
+    if (table_file) {
+        PRINTV("table %s %s\n", table->restored ? "restored from" : "created in", table_file);
+    }
+    if (snapshot_keys) {
+        // Borrows the first worker's thread id, like replaying the log
+        ht_online(table, 0);
+        if (snapshot_load(table, snapshot_file) < 0) {
+            perror("snapshot_load");
+            exit(1);
+        }
+        ht_offline(table, 0);
+        PRINTV("loaded %" PRIu64 " keys from %s\n", snapshot_keys, snapshot_file);
+    }
+    // The signal and log threads inherit our mask - they run anywhere
+    affinity_unpin(&placement);
+
+    // Route SIGUSR1/SIGTERM/SIGINT to the signal thread - threads created
+    // after this inherit the blocked mask
+    static sigset_t sigs;
+    pthread_t signal_thread;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+    sigaddset(&sigs, SIGUSR2);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    // The log's committer thread must not take the signals either, and the
+    // signal thread flushes the log, so open it in between
+    if (wal_file) {
+        // Replaying writes to the table, which needs an online thread id -
+        // borrow the first worker's, it starts offline again afterwards
+        ht_online(table, 0);
+        // The snapshot already holds the records before its offset
+        if (wal_open(&wal, wal_file, wal_sync, wal_period_ms, ring, snapshot_wal_offset,
+                    replay) < 0) {
+            perror("wal_open");
+            exit(1);
+        }
+        ht_offline(table, 0);
+        // A crash lost the end of the log, but not what the snapshot holds of
+        // it - new records go where the log ends, so replay from there
+        if (wal_offset(&wal) < snapshot_wal_offset &&
+                snapshot_set_wal_offset(snapshot_file, wal_offset(&wal))) {
+            perror(snapshot_file);
+            exit(1);
+        }
+        ht_set_log(table, log_change, &wal);
+        PRINTV("write-ahead log %s, %s sync\n", wal_file, wal_sync_name(wal_sync));
+    }
+
+    if (pthread_create(&signal_thread, NULL, &signal_function, &sigs)) {
+        perror("pthread_create");
+    }
 
     // // start threads
     for (int i = 0; i < num_threads; i++) {
-        struct thread_context context;
-        context.tid = i;
-        if (pthread_create(&threads[i], NULL, &thread_function, &context)) {
+        contexts[i].tid = i;
+        if (cache_slots &&
+                (contexts[i].cache = calloc(cache_slots, sizeof(struct cache_entry))) == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        if (pthread_create(&threads[i], NULL, &thread_function, &contexts[i])) {
             perror("pthread_create");
         }
     }
@@ -192,5 +740,5 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    //hash_table_destroy(table);
+    ht_destroy(table);
 }
@@ -0,0 +1,169 @@
+/*
+ * Watches a running server through the stats region of the shared mapping
+ * (see stats.h) - the server is not told, and pays nothing extra for it
+ * Every interval it prints each server thread's throughput, lock and empty
+ * ring waits and utilization, and the latency percentiles of the requests
+ * completed during the interval
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ring_buffer.h"
+#include "stats.h"
+
+char *shm_file = "shmem_file";
+double interval = 1.0;
+int count = 0; /* reports to print, 0 for no limit */
+
+/* What one report is diffed against */
+struct sample {
+    uint64_t ns;
+    struct thread_stats threads[STATS_MAX_THREADS];
+    struct lat_hist queue[STATS_NUM_OPS];
+    struct lat_hist exec[STATS_NUM_OPS];
+};
+
+/* Copy the live region - each counter is whole, though not all from the same instant */
+void take_sample(struct stats_region *stats, struct sample *s) {
+    memset(s, 0, sizeof(struct sample));
+    s->ns = stats_now();
+    for (uint32_t i = 0; i < stats->num_threads; i++) {
+        struct thread_stats *src = &stats->threads[i], *dst = &s->threads[i];
+        for (int op = 0; op < STATS_NUM_OPS; op++) {
+            dst->ops[op] = STAT_READ(src->ops[op]);
+            hist_merge(&s->queue[op], &src->queue[op], 1);
+            hist_merge(&s->exec[op], &src->exec[op], 1);
+        }
+        dst->requests = STAT_READ(src->requests);
+        dst->batches = STAT_READ(src->batches);
+        dst->empty_waits = STAT_READ(src->empty_waits);
+        dst->lock_waits = STAT_READ(src->lock_waits);
+        dst->busy_ns = STAT_READ(src->busy_ns);
+        dst->idle_ns = STAT_READ(src->idle_ns);
+    }
+}
+
+void print_interval(struct stats_region *stats, struct sample *prev, struct sample *cur) {
+    static const char *names[STATS_NUM_OPS] = { "put", "get" };
+    double secs = (cur->ns - prev->ns) / 1e9;
+    uint64_t total = 0;
+
+    printf("--- %.1f s since the server started\n", (cur->ns - stats->start_ns) / 1e9);
+    printf("thread %12s %12s %14s %14s %6s\n", "ops/s", "requests/s", "lock waits/s",
+            "empty waits/s", "util");
+    for (uint32_t i = 0; i < stats->num_threads; i++) {
+        struct thread_stats *p = &prev->threads[i], *c = &cur->threads[i];
+        uint64_t ops = c->ops[STATS_PUT] + c->ops[STATS_GET] - p->ops[STATS_PUT] - p->ops[STATS_GET];
+        uint64_t busy = c->busy_ns - p->busy_ns, idle = c->idle_ns - p->idle_ns;
+        total += ops;
+        printf("%6u %12.0f %12.0f %14.0f %14.0f %5.1f%%\n", i, ops / secs,
+                (c->requests - p->requests) / secs, (c->lock_waits - p->lock_waits) / secs,
+                (c->empty_waits - p->empty_waits) / secs,
+                busy + idle ? 100.0 * busy / (busy + idle) : 0.0);
+    }
+    printf(" total %12.0f\n", total / secs);
+    // Percentiles of this interval only - max is the largest since the start
+    for (int op = 0; op < STATS_NUM_OPS; op++) {
+        char name[32];
+        struct lat_hist queue = cur->queue[op], exec = cur->exec[op];
+        hist_merge(&queue, &prev->queue[op], -1);
+        hist_merge(&exec, &prev->exec[op], -1);
+        snprintf(name, sizeof(name), "%s queue", names[op]);
+        hist_print(&queue, name, stdout);
+        snprintf(name, sizeof(name), "%s exec", names[op]);
+        hist_print(&exec, name, stdout);
+    }
+    fflush(stdout);
+}
+
+void usage(char *name) {
+    printf("Usage: %s [-h] [-f shm_file] [-i interval] [-n count]\n", name);
+    printf("-h show this help\n");
+    printf("-f shared memory file of the client and server (default: shmem_file)\n");
+    printf("-i seconds between reports (default: 1)\n");
+    printf("-n number of reports, 0 for no limit (default: 0)\n");
+}
+
+static int parse_args(int argc, char **argv) {
+    int op;
+    while ((op = getopt(argc, argv, "hf:i:n:")) != -1) {
+        switch (op) {
+        case 'h':
+            usage(argv[0]);
+            exit(EXIT_SUCCESS);
+            break;
+        case 'f':
+            shm_file = optarg;
+            break;
+        case 'i':
+            interval = atof(optarg);
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (interval <= 0 || count < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    static struct sample samples[2];
+    struct stat file_info;
+    struct ring *ring;
+    struct stats_region *stats;
+    char *mem;
+    int fd;
+
+    if (parse_args(argc, argv) != 0)
+        exit(EXIT_FAILURE);
+
+    if ((fd = open(shm_file, O_RDONLY)) < 0 || fstat(fd, &file_info)) {
+        perror(shm_file);
+        exit(EXIT_FAILURE);
+    }
+    if ((size_t)file_info.st_size < sizeof(struct ring)) {
+        printf("%s does not hold a ring - is the client running?\n", shm_file);
+        exit(EXIT_FAILURE);
+    }
+    mem = mmap(NULL, file_info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    ring = (struct ring *)mem;
+    if (ring->stats_off == 0 || ring->stats_off % 64 ||
+            ring->stats_off + sizeof(struct stats_region) > (size_t)file_info.st_size) {
+        printf("%s has no stats region\n", shm_file);
+        exit(EXIT_FAILURE);
+    }
+    stats = (struct stats_region *)(mem + ring->stats_off);
+    // The client sets the region up before it starts the server
+    while (atomic_load_explicit(&stats->magic, memory_order_acquire) != STATS_MAGIC)
+        usleep(interval * 1e6);
+    if (stats->num_threads == 0 || stats->num_threads > STATS_MAX_THREADS) {
+        printf("stats region has %u threads\n", stats->num_threads);
+        exit(EXIT_FAILURE);
+    }
+
+    take_sample(stats, &samples[0]);
+    for (int i = 1; count == 0 || i <= count; i++) {
+        usleep(interval * 1e6);
+        take_sample(stats, &samples[i & 1]);
+        print_interval(stats, &samples[(i - 1) & 1], &samples[i & 1]);
+    }
+    munmap(mem, file_info.st_size);
+    return 0;
+}
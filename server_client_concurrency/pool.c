@@ -0,0 +1,96 @@
+#include "pool.h"
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void count_peak(struct pool *p) {
+    uint64_t total = atomic_load_explicit(&p->in_use, memory_order_relaxed) +
+        atomic_load_explicit(&p->cached, memory_order_relaxed);
+    uint64_t peak = atomic_load_explicit(&p->peak, memory_order_relaxed);
+
+    while (total > peak &&
+            !atomic_compare_exchange_weak(&p->peak, &peak, total))
+        ;
+}
+
+void pool_init(struct pool *p, uint64_t max_cached) {
+    memset(p, 0, sizeof(struct pool));
+    p->max_cached = max_cached;
+    pthread_mutex_init(&p->lock, NULL);
+}
+
+static void free_list(struct pool_block *b) {
+    while (b) {
+        struct pool_block *next = b->next;
+        free(b);
+        b = next;
+    }
+}
+
+void pool_destroy(struct pool *p) {
+    for (int cls = 0; cls < POOL_CLASSES; cls++) {
+        free_list(p->depot[cls]);
+        for (int i = 0; i < POOL_MAX_THREADS; i++)
+            free_list(p->threads[i].free[cls]);
+    }
+    pthread_mutex_destroy(&p->lock);
+}
+
+void *pool_alloc(struct pool *p, int tid, int cls, uint64_t bytes) {
+    struct pool_block *b = NULL;
+
+    atomic_fetch_add_explicit(&p->allocs, 1, memory_order_relaxed);
+    if (tid >= 0 && (b = p->threads[tid].free[cls])) {
+        p->threads[tid].free[cls] = b->next;
+        p->threads[tid].count[cls]--;
+    } else {
+        pthread_mutex_lock(&p->lock);
+        if ((b = p->depot[cls]))
+            p->depot[cls] = b->next;
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    if (b) {
+        atomic_fetch_add_explicit(&p->reused, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&p->cached, bytes, memory_order_relaxed);
+    } else if (posix_memalign((void **)&b, 64, bytes)) {
+        return NULL;
+    }
+    atomic_fetch_add_explicit(&p->in_use, bytes, memory_order_relaxed);
+    count_peak(p);
+    return b;
+}
+
+void pool_free(struct pool *p, int tid, int cls, void *ptr, uint64_t bytes) {
+    struct pool_block *b = ptr;
+
+    atomic_fetch_sub_explicit(&p->in_use, bytes, memory_order_relaxed);
+    // Racy, so the cap may be overshot by a block or two
+    if (atomic_load_explicit(&p->cached, memory_order_relaxed) + bytes > p->max_cached) {
+        free(b);
+        return;
+    }
+    atomic_fetch_add_explicit(&p->cached, bytes, memory_order_relaxed);
+    if (tid >= 0 && p->threads[tid].count[cls] < POOL_CACHE) {
+        b->next = p->threads[tid].free[cls];
+        p->threads[tid].free[cls] = b;
+        p->threads[tid].count[cls]++;
+        return;
+    }
+    pthread_mutex_lock(&p->lock);
+    b->next = p->depot[cls];
+    p->depot[cls] = b;
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pool_report(struct pool *p, const char *name, FILE *out) {
+    uint64_t in_use = atomic_load(&p->in_use);
+    uint64_t cached = atomic_load(&p->cached);
+    uint64_t allocs = atomic_load(&p->allocs);
+
+    fprintf(out, "%s: %.1f MB in use, %.1f MB cached, footprint %.2fx in use (peak %.1f MB), "
+            "%" PRIu64 " allocations, %.1f%% reused\n", name, in_use / 1048576.0, cached / 1048576.0,
+            in_use ? (double)(in_use + cached) / in_use : 0.0, atomic_load(&p->peak) / 1048576.0,
+            allocs, allocs ? 100.0 * atomic_load(&p->reused) / allocs : 0.0);
+}
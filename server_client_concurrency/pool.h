@@ -0,0 +1,61 @@
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Size classes - all blocks of a class must have the same size */
+#define POOL_CLASSES 32
+/* Threads with free lists of their own (ids 0 .. POOL_MAX_THREADS - 1) */
+#define POOL_MAX_THREADS 128
+/* Free blocks a thread keeps per class - more go to the shared depot */
+#define POOL_CACHE 4
+
+/* A free block - the link lives in its first bytes */
+struct pool_block {
+    struct pool_block *next;
+};
+
+/* Free blocks private to one thread, on cache lines of their own */
+struct __attribute__((aligned(64))) pool_cache {
+    struct pool_block *free[POOL_CLASSES];
+    uint8_t count[POOL_CLASSES];
+};
+
+/*
+ * Recycles large blocks of a few fixed sizes, so a thread that frees a block
+ * and one that needs a block of the same size soon after skip malloc (and the
+ * page faults of fresh memory)
+ * A thread first looks at its own free lists, then at the depot, which
+ * takes a lock - both see little traffic, as they only serve the rare
+ * resize. Free blocks beyond max_cached bytes go back to malloc.
+ */
+struct pool {
+    uint64_t max_cached;
+    pthread_mutex_t lock;       /* protects the depot */
+    struct pool_block *depot[POOL_CLASSES];
+    /* Counters, updated atomically */
+    uint64_t in_use;            /* bytes handed out and not freed yet */
+    uint64_t cached;            /* bytes in free lists, the depot's and the threads' */
+    uint64_t peak;              /* highest in_use + cached */
+    uint64_t allocs;
+    uint64_t reused;            /* allocations served from a free list */
+    struct pool_cache threads[POOL_MAX_THREADS];
+};
+
+void pool_init(struct pool *p, uint64_t max_cached);
+
+/* Give every free block back to malloc - blocks still in use are the caller's */
+void pool_destroy(struct pool *p);
+
+/*
+ * A block of bytes bytes of class cls - its contents are undefined
+ * tid is the calling thread's id, or -1 for a thread without one (that only
+ * uses the depot)
+ * @return NULL if malloc failed
+ */
+void *pool_alloc(struct pool *p, int tid, int cls, uint64_t bytes);
+void pool_free(struct pool *p, int tid, int cls, void *b, uint64_t bytes);
+
+/* Bytes in use and cached, and footprint / in use - how much more the pool
+ * holds on to than its users need */
+void pool_report(struct pool *p, const char *name, FILE *out);
@@ -1,59 +1,334 @@
 #include "ring_buffer.h"
+#include "futex.h"
 #include <pthread.h>
-#include <semaphore.h>
 #include <stdatomic.h>
 #include <stdio.h>
 #include<unistd.h>
 #include <sched.h>
 
-int init_ring(struct ring *r) {
+__thread uint64_t ring_empty_waits;
 
-    // Initialize semaphores
-    sem_init(&r->sem_mutex, 1, 1);
-    sem_init(&r->sem_empty, 1, RING_SIZE);
-    sem_init(&r->sem_full, 1, 0);
-    // Initialize indices
+int init_ring(struct ring *r, uint32_t capacity, enum RING_WAIT_MODE mode) {
+    if (mode > RING_WAIT_BLOCK || capacity < 2 || capacity > RING_MAX_SIZE ||
+            (capacity & (capacity - 1)))
+        return -1;
+
+    r->capacity = capacity;
+    r->mask = capacity - 1;
+    r->wait_mode = mode;
+    r->num_sq = 0;
+    r->slab_off = 0;
+    r->stats_off = 0;
+    // Initialize indices and event words
     r->p_tail = 0;
     r->p_head = 0;
     r->c_tail = 0;
     r->c_head = 0;
 
-    for(int i = 0; i < RING_SIZE; i++) {
-        r->buffer[i].k = 0;
-        r->buffer[i].v = 0;
+    // Slot i is free for the producer that reserves position i
+    for(uint32_t i = 0; i < capacity; i++) {
+        r->buffer[i].seq = i;
+        r->buffer[i].desc.k = 0;
+        r->buffer[i].desc.v = 0;
     }
     return 0;
 }
 
+/*
+ * One step of waiting for the other side of the ring to make progress
+ * Spins while the ring's spin budget lasts, then arms the event word evc
+ * @return 1 if evc was armed - *key must then be passed to evc_wait once the
+ * caller has re-checked its condition, 0 if we only spun
+ */
+static int ring_backoff(struct ring *r, uint32_t *evc, int *spins, uint32_t *key) {
+    if (r->wait_mode == RING_WAIT_SPIN ||
+            (r->wait_mode == RING_WAIT_HYBRID && (*spins)++ < RING_SPIN_LIMIT)) {
+        cpu_relax();
+        return 0;
+    }
+    *key = evc_prepare(evc);
+    return 1;
+}
+
+// Wait for a slot whose position has already been reserved - the thread that
+// owns it is in the middle of a copy, so this is always short
+static void slot_wait(struct ring_slot *slot, uint32_t seq) {
+    int spins = 0;
+    while (atomic_load_explicit(&slot->seq, memory_order_acquire) != seq) {
+        if (spins++ < RING_SPIN_LIMIT)
+            cpu_relax();
+        else
+            sched_yield();
+    }
+}
+
+// Reserve between 1 and want free positions, blocking while the ring is full
+static uint32_t reserve_free(struct ring *r, int want, int *cnt) {
+    int spins = 0, armed = 0;
+    uint32_t key;
+    while (1) {
+        uint32_t cons = atomic_load_explicit(&r->c_head, memory_order_acquire);
+        uint32_t pos = atomic_load_explicit(&r->p_head, memory_order_relaxed);
+        int32_t room = (int32_t)r->capacity - (int32_t)(pos - cons);
+        if (room <= 0) {
+            if (armed) {
+                evc_wait(&r->c_tail, key);
+                armed = 0;
+            } else {
+                armed = ring_backoff(r, &r->c_tail, &spins, &key);
+            }
+            continue;
+        }
+
+        int n = room < want ? room : want;
+        if (atomic_compare_exchange_weak_explicit(&r->p_head, &pos, pos + n,
+                    memory_order_relaxed, memory_order_relaxed)) {
+            *cnt = n;
+            return pos;
+        }
+    }
+}
+
+// Reserve between 1 and want published positions, blocking while the ring is empty
+static uint32_t reserve_used(struct ring *r, int want, int *cnt) {
+    int spins = 0, armed = 0, waited = 0;
+    uint32_t key;
+    while (1) {
+        uint32_t pos = atomic_load_explicit(&r->c_head, memory_order_relaxed);
+        uint32_t prod = atomic_load_explicit(&r->p_head, memory_order_acquire);
+        uint32_t avail = prod - pos;
+        if (avail == 0) {
+            ring_empty_waits += !waited;
+            waited = 1;
+            if (armed) {
+                evc_wait(&r->p_tail, key);
+                armed = 0;
+            } else {
+                armed = ring_backoff(r, &r->p_tail, &spins, &key);
+            }
+            continue;
+        }
+
+        int n = avail < (uint32_t)want ? (int)avail : want;
+        if (atomic_compare_exchange_weak_explicit(&r->c_head, &pos, pos + n,
+                    memory_order_relaxed, memory_order_relaxed)) {
+            *cnt = n;
+            return pos;
+        }
+    }
+}
+
+// Submit n items to the ring buffer, one reservation per run of free slots
+void ring_submit_batch(struct ring *r, struct buffer_descriptor *bds, int n) {
+    while (n > 0) {
+        int cnt;
+        uint32_t pos = reserve_free(r, n, &cnt);
+
+        for (int i = 0; i < cnt; i++, pos++) {
+            // The consumer of the previous lap may still be copying out of this slot
+            struct ring_slot *slot = &r->buffer[pos & r->mask];
+            slot_wait(slot, pos);
+
+            slot->desc = bds[i];
+            bds[i].ready = 0;
+            atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+        }
+        if (r->wait_mode != RING_WAIT_SPIN)
+            evc_notify(&r->p_tail);
+
+        bds += cnt;
+        n -= cnt;
+    }
+}
+
+// Retrieve up to max items from the ring buffer
+int ring_get_batch(struct ring *r, struct buffer_descriptor *bds, int max) {
+    int cnt;
+    uint32_t pos = reserve_used(r, max, &cnt);
+
+    for (int i = 0; i < cnt; i++, pos++) {
+        // The producer that reserved pos may not have published yet
+        struct ring_slot *slot = &r->buffer[pos & r->mask];
+        slot_wait(slot, pos + 1);
+
+        bds[i] = slot->desc;
+        atomic_store_explicit(&slot->seq, pos + r->capacity, memory_order_release);
+    }
+    if (r->wait_mode != RING_WAIT_SPIN)
+        evc_notify(&r->c_tail);
+    return cnt;
+}
+
 // Submit a new item to the ring buffer
 void ring_submit(struct ring *r, struct buffer_descriptor *bd) {
-    uint32_t p_head;
-    sem_wait(&r->sem_empty);
-    sem_wait(&r->sem_mutex);
-    do {
-      p_head = r->p_head;
-    } while (!atomic_compare_exchange_strong(&(r->p_head), &(p_head), (r->p_head + 1) % RING_SIZE));
-    
-    r->buffer[p_head] = *bd;
-    bd->ready = 0;
-   
-    while (!atomic_compare_exchange_strong(&(r->p_tail), &(p_head), (r->p_tail + 1) % RING_SIZE)) {}
-    sem_post(&r->sem_mutex);
-    sem_post(&r->sem_full);
+    ring_submit_batch(r, bd, 1);
 }
 
 // Retrieve an item from the ring buffer
 void ring_get(struct ring *r, struct buffer_descriptor *bd) {
-    uint32_t c_head;
-    sem_wait(&r->sem_full);
-    sem_wait(&r->sem_mutex);
-    do {
-      c_head = r->c_head;
-    } while (!atomic_compare_exchange_strong(&(r->c_head), &(c_head), (r->c_head + 1) % RING_SIZE));
-
-    *bd = r->buffer[c_head];
-    
-    while (!atomic_compare_exchange_strong(&(r->c_tail), &(c_head), (r->c_tail + 1) % RING_SIZE)) {}
-    sem_post(&r->sem_mutex);
-    sem_post(&r->sem_empty);
+    ring_get_batch(r, bd, 1);
+}
+
+// Publish a completion, then ring the submitter's doorbell if it sleeps
+void ring_complete(struct ring *r, struct buffer_descriptor *result, struct completion_doorbell *db) {
+    atomic_store_explicit(&result->ready, 1, memory_order_release);
+    if (r->wait_mode != RING_WAIT_SPIN)
+        evc_notify(&db->evc);
+}
+
+// Wait for a completion using the same spin-then-futex policy as the ring
+void ring_wait_completion(struct ring *r, struct buffer_descriptor *comp, struct completion_doorbell *db) {
+    ring_wait_completion_until(r, comp, db, 0);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int ring_wait_completion_until(struct ring *r, struct buffer_descriptor *comp,
+        struct completion_doorbell *db, uint64_t deadline) {
+    int spins = 0, armed = 0;
+    uint32_t key;
+    while (atomic_load_explicit(&comp->ready, memory_order_acquire) != 1) {
+        uint64_t now = deadline ? now_ns() : 0;
+        if (deadline && now >= deadline)
+            return -1;
+        if (armed) {
+            if (deadline)
+                evc_wait_for(&db->evc, key, deadline - now);
+            else
+                evc_wait(&db->evc, key);
+            armed = 0;
+        } else {
+            armed = ring_backoff(r, &db->evc, &spins, &key);
+        }
+    }
+    return 0;
+}
+
+int init_sq_rings(struct ring *r, int num_sq, uint32_t sq_off) {
+    if (num_sq < 1 || num_sq > MAX_SQ || sq_off % 64 || sq_off < ring_bytes(r->capacity))
+        return -1;
+
+    r->sq_off = sq_off;
+    r->num_sq = num_sq;
+    for (int i = 0; i < SQ_BELL_WORDS; i++)
+        r->sq_bell[i] = 0;
+    r->sq_evc = 0;
+    for (int i = 0; i < num_sq; i++) {
+        struct sq_ring *q = sq_at(r, i);
+        q->head = 0;
+        q->tail = 0;
+        q->evc = 0;
+    }
+    return 0;
+}
+
+// Submit n items to our own queue - the only writer of q->head is us
+void sq_submit_batch(struct ring *r, int qid, struct buffer_descriptor *bds, int n) {
+    struct sq_ring *q = sq_at(r, qid);
+    uint64_t *bell = &r->sq_bell[qid / 64];
+    uint64_t bit = 1ULL << (qid % 64);
+    int spins = 0, armed = 0;
+    uint32_t key;
+
+    while (n > 0) {
+        uint32_t head = q->head;
+        uint32_t room = r->capacity - (head - atomic_load_explicit(&q->tail, memory_order_acquire));
+        if (room == 0) {
+            if (armed) {
+                evc_wait(&q->evc, key);
+                armed = 0;
+            } else {
+                armed = ring_backoff(r, &q->evc, &spins, &key);
+            }
+            continue;
+        }
+
+        int cnt = room < (uint32_t)n ? (int)room : n;
+        for (int i = 0; i < cnt; i++) {
+            q->buffer[(head + i) & r->mask] = bds[i];
+            bds[i].ready = 0;
+        }
+        atomic_store_explicit(&q->head, head + cnt, memory_order_release);
+
+        // Pairs with the fetch_and in sq_get_batch: either the server sees
+        // the new head after clearing our bit, or we see the bit cleared
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!(atomic_load_explicit(bell, memory_order_relaxed) & bit))
+            atomic_fetch_or(bell, bit);
+        if (r->wait_mode != RING_WAIT_SPIN)
+            evc_notify(&r->sq_evc);
+
+        bds += cnt;
+        n -= cnt;
+        spins = 0;
+    }
+}
+
+// Drain up to max descriptors from one queue we own
+static int sq_take(struct ring *r, struct sq_ring *q, struct buffer_descriptor *bds, int max) {
+    uint32_t tail = q->tail;
+    uint32_t avail = atomic_load_explicit(&q->head, memory_order_acquire) - tail;
+    int cnt = avail < (uint32_t)max ? (int)avail : max;
+
+    for (int i = 0; i < cnt; i++)
+        bds[i] = q->buffer[(tail + i) & r->mask];
+    if (cnt > 0) {
+        atomic_store_explicit(&q->tail, tail + cnt, memory_order_release);
+        if (r->wait_mode != RING_WAIT_SPIN)
+            evc_notify(&q->evc);
+    }
+    return cnt;
+}
+
+// Look once at every queue assigned to p whose doorbell bit is set
+static int sq_scan(struct ring *r, struct sq_poller *p, struct buffer_descriptor *bds, int max) {
+    int nq = r->num_sq;
+    int mine = (nq - p->tid + p->nthreads - 1) / p->nthreads;
+
+    for (int j = 0; j < mine; j++) {
+        int qid = p->tid + ((p->next + j) % mine) * p->nthreads;
+        uint64_t *bell = &r->sq_bell[qid / 64];
+        uint64_t bit = 1ULL << (qid % 64);
+
+        if (!(atomic_load_explicit(bell, memory_order_relaxed) & bit))
+            continue;
+        atomic_fetch_and(bell, ~bit);
+
+        struct sq_ring *q = sq_at(r, qid);
+        int cnt = sq_take(r, q, bds, max);
+        // Leftovers - keep the bit so we come back after serving the others
+        if (atomic_load_explicit(&q->head, memory_order_relaxed) != q->tail)
+            atomic_fetch_or(bell, bit);
+        if (cnt > 0) {
+            p->next = (p->next + j + 1) % mine;
+            return cnt;
+        }
+    }
+    return 0;
+}
+
+// Poll our queues, spinning and then sleeping on sq_evc while all are empty
+int sq_get_batch(struct ring *r, struct sq_poller *p, struct buffer_descriptor *bds, int max) {
+    int spins = 0, armed = 0, waited = 0;
+    uint32_t key;
+
+    if (p->tid >= (int)r->num_sq)
+        return 0;
+    while (1) {
+        int cnt = sq_scan(r, p, bds, max);
+        if (cnt > 0)
+            return cnt;
+        ring_empty_waits += !waited;
+        waited = 1;
+        if (armed) {
+            evc_wait(&r->sq_evc, key);
+            armed = 0;
+        } else {
+            armed = ring_backoff(r, &r->sq_evc, &spins, &key);
+        }
+    }
 }
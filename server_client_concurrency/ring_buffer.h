@@ -3,13 +3,38 @@
 #include <pthread.h>
 #include <stdbool.h>
 #include "common.h"
-#include <semaphore.h>
 
+/* Default and largest ring capacity - the actual capacity is picked in
+ * init_ring and must be a power of two so indices can be masked */
 #define RING_SIZE 1024
+#define RING_MAX_SIZE (1U << 24)
+/* Number of pause iterations before a hybrid waiter parks on a futex */
+#define RING_SPIN_LIMIT 1024
+/* Largest MGET/MPUT vector */
+#define MAX_VEC 256
+/* Upper bound on per-client-thread submission queues (one doorbell bit each) */
+#define MAX_SQ 128
+#define SQ_BELL_WORDS (MAX_SQ / 64)
+
+/* How a thread waits for a full/empty ring - chosen once in init_ring */
+enum RING_WAIT_MODE {
+	RING_WAIT_SPIN = 0,	/* never sleep - lowest latency, burns a core per waiter */
+	RING_WAIT_HYBRID,	/* spin RING_SPIN_LIMIT times, then sleep on a futex */
+	RING_WAIT_BLOCK		/* go straight to the futex */
+};
 
 enum REQUEST_TYPE {
   PUT = 0,
-  GET
+  GET,
+  DEL,
+  MGET,	/* vectored - see vec_off */
+  MPUT
+};
+
+/* One element of an MGET/MPUT vector */
+struct kv_pair {
+	key_type k;
+	value_type v;
 };
 
 /* Client sends requests using this format - Each element of the ring is 
@@ -32,41 +57,141 @@ struct buffer_descriptor {
 	 * The client program will reset the flag to 0 before using the same 
 	 * location for completion */
   	int ready;
+	/* Offset (in bytes) of the submitting thread's completion_doorbell -
+	 * the kv_store pokes it through ring_complete after setting ready */
+	int db_off;
+	/* MGET/MPUT only: offset (in bytes) of vec_len kv_pairs in the client's
+	 * part of the shared region - the kv_store runs the whole vector (MGET
+	 * fills in the values in place) and then posts a single completion */
+	int vec_off;
+	int vec_len;
+	/* With a value area (see ring->slab_off) v is the handle of a slab
+	 * block rather than the value itself, and this is its length - a PUT
+	 * hands its block over to the kv_store, a GET result carries a
+	 * reference the client drops with slab_put once it has read the bytes */
+	uint32_t val_len;
+	/* CLOCK_MONOTONIC when the client sent the request, 0 if it did not
+	 * say - the kv_store counts the time until it takes it as queueing */
+	uint64_t sent_ns;
+};
+
+/* One per client thread, right after the ring - an event word (see futex.h)
+ * that lets a client thread sleep until one of its requests completes */
+struct __attribute__((aligned(64))) completion_doorbell {
+	uint32_t evc;
+	char pad[60];
+};
+
+/* One element of the ring - seq tells producers and consumers who owns the slot:
+ * seq == pos      -> free, the producer that reserved position pos may fill it
+ * seq == pos + 1  -> holds the descriptor published at position pos
+ * After consuming position pos the consumer sets seq to pos + capacity, which
+ * hands the slot to the producer of the next lap */
+struct ring_slot {
+	uint32_t seq;
+	struct buffer_descriptor desc;
 };
 
 /* This structure is laid out at the beginning of the shared memory region
- * You can add new fields to the structure (It's very unlikely that you need to) */
+ * You can add new fields to the structure (It's very unlikely that you need to)
+ * It doubles as the header of the region: a process that maps the region
+ * learns the ring geometry from capacity/mask instead of a compile-time size
+ * All indices are free running 32-bit counters - capacity is a power of
+ * two so that (index & mask) stays correct across wrap-around */
 struct __attribute__((packed, aligned(64))) ring {
-	/* Producer tail - where the last valid item is */
+	/* Producer event word - bumped by producers after they publish, but only
+	 * when a consumer has flagged that it is asleep on it (see futex.h) */
 	uint32_t p_tail; 
 	char pad1[60];
-	/* Producer head - where producers are putting new elements
-	 * It should be always ahead of p_tail - elements between p_tail and
-	 * p_head may not be valid yet (in process of copying data?) */
+	/* Producer head - next position a producer will reserve
+	 * Elements between the consumers and p_head may not be valid yet (in
+	 * process of copying data?) - the slot seq says when they are */
 	uint32_t p_head; 
 	char pad2[60];
-	/* Consumer tail - first item to be consumed - producers can't write
-	 * any data here - producers can only write before c_tail */
+	/* Consumer event word - bumped by consumers after they free slots, but
+	 * only when a producer has flagged that it is asleep on it */
 	uint32_t c_tail;
 	char pad3[60];
-	/* Consumer head - next consumer will consume the data pointed by c_head */
+	/* Consumer head - next consumer will consume the data at position c_head */
 	uint32_t c_head;
 	char pad4[60];
-	/* An array of structs - This is the actual ring */
-	struct buffer_descriptor buffer[RING_SIZE];
+	/* Number of slots (a power of two) and capacity - 1 - read-only after init_ring */
+	uint32_t capacity;
+	uint32_t mask;
+	/* enum RING_WAIT_MODE - read-only after init_ring */
+	uint32_t wait_mode;
+	/* Number of per-client-thread submission queues - 0 means every client
+	 * thread uses the shared slots below (read-only after init_sq_rings) */
+	uint32_t num_sq;
+	/* Byte offset of the first sq_ring from the start of the shared region */
+	uint32_t sq_off;
+	/* Byte offset of the value area (a struct slab) from the start of the
+	 * shared region - 0 if values are plain numbers (read-only after init) */
+	uint32_t slab_off;
+	/* Byte offset of the stats region (a struct stats_region) from the
+	 * start of the shared region - 0 if there is none (read-only after init) */
+	uint32_t stats_off;
+	char pad5[36];
+	/* Doorbell bitmap - bit i is set when submission queue i may hold
+	 * descriptors that its server thread has not seen yet */
+	uint64_t sq_bell[SQ_BELL_WORDS];
+	char pad6[64 - SQ_BELL_WORDS * 8];
+	/* Server threads with no work in any of their queues sleep here */
+	uint32_t sq_evc;
+	char pad7[60];
+	/* An array of capacity slots - This is the actual ring */
+	struct ring_slot buffer[];
+};
+
+/* Single-producer/single-consumer submission queue - one per client thread
+ * when the client runs with per-thread queues. Only the owning client thread
+ * moves head and only the server thread the queue is assigned to
+ * (queue i belongs to server thread i % num_server_threads) moves tail, so
+ * neither side needs atomic read-modify-writes */
+struct __attribute__((packed, aligned(64))) sq_ring {
+	/* Next position the client thread will fill */
+	uint32_t head;
+	char pad1[60];
+	/* Next position the server thread will take */
+	uint32_t tail;
+	char pad2[60];
+	/* The client thread sleeps here while its queue is full */
+	uint32_t evc;
+	char pad3[60];
+	/* Same capacity as the shared ring */
+	struct buffer_descriptor buffer[];
+};
 
-        sem_t sem_mutex;
-        sem_t sem_empty;
-        sem_t sem_full;
+/* Per server thread state for polling submission queues */
+struct sq_poller {
+	int tid;	/* this server thread's index */
+	int nthreads;	/* number of server threads sharing the queues */
+	int next;	/* queue to look at first next time, for fairness */
 };
 
+/* Bytes taken by a ring / a submission queue of the given capacity,
+ * rounded up so that whatever follows starts on its own cache line */
+static inline size_t ring_bytes(uint32_t capacity) {
+	return (sizeof(struct ring) + capacity * sizeof(struct ring_slot) + 63) & ~(size_t)63;
+}
+
+static inline size_t sq_ring_bytes(uint32_t capacity) {
+	return (sizeof(struct sq_ring) + capacity * sizeof(struct buffer_descriptor) + 63) & ~(size_t)63;
+}
+
+static inline struct sq_ring *sq_at(struct ring *r, int i) {
+	return (struct sq_ring *)((char *)r + r->sq_off + i * sq_ring_bytes(r->capacity));
+}
+
 /*
  * Initialize the ring
- * @param r A pointer to the ring
+ * @param r A pointer to the ring - ring_bytes(capacity) bytes must be mapped there
+ * @param capacity number of slots, a power of two no larger than RING_MAX_SIZE
+ * @param mode how threads wait when the ring is full or empty
  * @return 0 on success, negative otherwise - this negative value will be
  * printed to output by the client program
 */
-int init_ring(struct ring *r);
+int init_ring(struct ring *r, uint32_t capacity, enum RING_WAIT_MODE mode);
 
 /*
  * Submit a new item - should be thread-safe
@@ -86,3 +211,86 @@ void ring_submit(struct ring *r, struct buffer_descriptor *bd);
  * the signature.
 */
 void ring_get(struct ring *r, struct buffer_descriptor *bd); 
+
+/*
+ * Submit n items - should be thread-safe
+ * Slots are reserved with a single update of p_head for as many items as
+ * there is room for, filled, and published before the next reservation
+ * This call will block the calling thread until all n items are in the ring
+ * @param r The shared ring
+ * @param bds An array of n valid buffer_descriptors
+ * @param n Number of descriptors in bds
+*/
+void ring_submit_batch(struct ring *r, struct buffer_descriptor *bds, int n);
+
+/*
+ * Get up to max items from the ring - should be thread-safe
+ * This call will block the calling thread if the ring is empty, otherwise
+ * it takes whatever is available (at most max) with a single update of c_head
+ * @param r A pointer to the shared ring
+ * @param bds array with room for max buffer_descriptors
+ * @param max maximum number of items to take
+ * @return number of items copied to bds (at least 1)
+*/
+int ring_get_batch(struct ring *r, struct buffer_descriptor *bds, int max);
+
+/* Times the calling thread found nothing to take in ring_get_batch or
+ * sq_get_batch and had to wait - for statistics */
+extern __thread uint64_t ring_empty_waits;
+
+/*
+ * Mark a request as completed and wake its submitter if it is asleep
+ * @param r The shared ring (its wait mode decides whether anyone can sleep)
+ * @param result The completion slot, already filled in except for ready
+ * @param db The submitting thread's doorbell (result->db_off)
+*/
+void ring_complete(struct ring *r, struct buffer_descriptor *result, struct completion_doorbell *db);
+
+/*
+ * Block until comp->ready is set - spins first, then sleeps on db
+ * according to the ring's wait mode
+ * @param r The shared ring
+ * @param comp The completion slot to wait for
+ * @param db The calling thread's doorbell
+*/
+void ring_wait_completion(struct ring *r, struct buffer_descriptor *comp, struct completion_doorbell *db);
+
+/*
+ * As ring_wait_completion, but gives up at deadline (CLOCK_MONOTONIC ns,
+ * 0 for never)
+ * @return 0 once comp->ready is set, -1 if the deadline passed first
+*/
+int ring_wait_completion_until(struct ring *r, struct buffer_descriptor *comp,
+        struct completion_doorbell *db, uint64_t deadline);
+
+/*
+ * Switch the ring to per-client-thread submission queues
+ * Must be called after init_ring and before any thread uses the ring
+ * @param r The shared ring
+ * @param num_sq Number of queues (one per client thread, at most MAX_SQ)
+ * @param sq_off Byte offset from r where num_sq queues of sq_ring_bytes(capacity)
+ * bytes each are laid out
+ * @return 0 on success, negative otherwise
+*/
+int init_sq_rings(struct ring *r, int num_sq, uint32_t sq_off);
+
+/*
+ * Submit n items to submission queue qid - only the thread owning qid may call this
+ * This call will block the calling thread until all n items are in the queue
+ * @param r The shared ring
+ * @param qid The calling client thread's queue
+ * @param bds An array of n valid buffer_descriptors
+ * @param n Number of descriptors in bds
+*/
+void sq_submit_batch(struct ring *r, int qid, struct buffer_descriptor *bds, int n);
+
+/*
+ * Get up to max items from the submission queues assigned to a server thread
+ * This call will block the calling thread while all of its queues are empty
+ * @param r The shared ring
+ * @param p This server thread's poller state
+ * @param bds array with room for max buffer_descriptors
+ * @param max maximum number of items to take
+ * @return number of items copied to bds - 0 only if no queue is assigned to p
+*/
+int sq_get_batch(struct ring *r, struct sq_poller *p, struct buffer_descriptor *bds, int max);
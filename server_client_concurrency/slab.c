@@ -0,0 +1,133 @@
+#include "slab.h"
+#include <inttypes.h>
+#include <stdatomic.h>
+
+#define SLAB_MAGIC 0x42414c53u  /* "SLAB" */
+
+#define HEAD_HANDLE(head) ((uint32_t)(head))
+#define HEAD_TAG(head) ((head) >> 32)
+
+static uint32_t class_size(int cls) {
+    return SLAB_MIN_BLOCK << cls;
+}
+
+int slab_init(struct slab *s, uint64_t size) {
+    if (size < sizeof(struct slab) + SLAB_CHUNK || size > UINT32_MAX)
+        return -1;
+    s->size = size;
+    s->next_chunk = sizeof(struct slab);
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        s->classes[i].head = 0;
+        s->classes[i].chunks = 0;
+    }
+    atomic_store(&s->magic, SLAB_MAGIC);
+    return 0;
+}
+
+int slab_check(struct slab *s, uint64_t size) {
+    return atomic_load(&s->magic) == SLAB_MAGIC && s->size <= size ? 0 : -1;
+}
+
+// Push the chain first..last onto the free list of cls
+static void push(struct slab *s, int cls, uint32_t first, uint32_t last) {
+    struct slab_class *c = &s->classes[cls];
+    uint64_t head = atomic_load(&c->head);
+
+    do {
+        atomic_store_explicit(&slab_block(s, last)->next, HEAD_HANDLE(head),
+                memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak(&c->head, &head,
+                (HEAD_TAG(head) << 32) | first));
+}
+
+static uint32_t pop(struct slab *s, int cls) {
+    struct slab_class *c = &s->classes[cls];
+    uint64_t head = atomic_load(&c->head);
+    uint32_t h, next;
+
+    do {
+        if ((h = HEAD_HANDLE(head)) == 0)
+            return 0;
+        // May be stale by the time we read it - then the tag has moved on
+        // and the exchange fails
+        next = atomic_load_explicit(&slab_block(s, h)->next, memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak(&c->head, &head,
+                ((HEAD_TAG(head) + 1) << 32) | next));
+    return h;
+}
+
+// Cut a fresh chunk into blocks of cls - keeps the first, frees the rest
+static uint32_t carve(struct slab *s, int cls) {
+    uint32_t bs = class_size(cls);
+    uint32_t h = atomic_load(&s->next_chunk);
+
+    do {
+        if ((uint64_t)h + SLAB_CHUNK > s->size)
+            return 0;
+    } while (!atomic_compare_exchange_weak(&s->next_chunk, &h, h + SLAB_CHUNK));
+    for (uint32_t b = h; b < h + SLAB_CHUNK; b += bs) {
+        slab_block(s, b)->cls = cls;
+        slab_block(s, b)->next = b + bs;
+    }
+    push(s, cls, h + bs, h + SLAB_CHUNK - bs);
+    atomic_fetch_add_explicit(&s->classes[cls].chunks, 1, memory_order_relaxed);
+    return h;
+}
+
+uint32_t slab_alloc(struct slab *s, uint32_t len) {
+    int cls = 0;
+    uint32_t h;
+
+    if (len > SLAB_MAX_VALUE)
+        return 0;
+    while (class_size(cls) < len + sizeof(struct slab_block))
+        cls++;
+    if ((h = pop(s, cls)) == 0 && (h = carve(s, cls)) == 0)
+        return 0;
+    slab_block(s, h)->len = len;
+    atomic_store(&slab_block(s, h)->refs, 1);
+    return h;
+}
+
+int slab_tryget(struct slab *s, uint32_t h) {
+    uint32_t *refs = &slab_block(s, h)->refs;
+    uint32_t n = atomic_load(refs);
+
+    do {
+        if (n == 0)
+            return 0;
+    } while (!atomic_compare_exchange_weak(refs, &n, n + 1));
+    return 1;
+}
+
+int slab_valid(struct slab *s, uint64_t size, uint32_t h) {
+    uint32_t first = sizeof(struct slab);
+    uint32_t chunk, cls;
+
+    if (h < first || h >= atomic_load(&s->next_chunk))
+        return 0;
+    // Chunks are carved back to back from the end of the header, each of
+    // one class - its first block says which
+    chunk = h - (h - first) % SLAB_CHUNK;
+    if ((uint64_t)chunk + SLAB_CHUNK > size)
+        return 0;
+    cls = atomic_load_explicit(&slab_block(s, chunk)->cls, memory_order_relaxed);
+    return cls < SLAB_CLASSES && (h - chunk) % class_size(cls) == 0;
+}
+
+void slab_put(struct slab *s, uint32_t h) {
+    if (atomic_fetch_sub(&slab_block(s, h)->refs, 1) == 1)
+        push(s, slab_block(s, h)->cls, h, h);
+}
+
+void slab_report(struct slab *s, FILE *out) {
+    uint32_t carved = atomic_load(&s->next_chunk);
+
+    fprintf(out, "values: %.1f of %.1f MB carved into blocks\n",
+            carved / 1048576.0, s->size / 1048576.0);
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        uint64_t chunks = atomic_load_explicit(&s->classes[i].chunks, memory_order_relaxed);
+        if (chunks)
+            fprintf(out, "  %5u B blocks: %" PRIu64 " chunks\n", class_size(i), chunks);
+    }
+}
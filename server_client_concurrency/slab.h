@@ -0,0 +1,82 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+
+/* Block sizes go up in powers of two from SLAB_MIN_BLOCK - the largest
+ * class holds a value of SLAB_MAX_VALUE bytes */
+#define SLAB_MIN_BLOCK 64
+#define SLAB_CLASSES 8
+#define SLAB_MAX_VALUE ((SLAB_MIN_BLOCK << (SLAB_CLASSES - 1)) - sizeof(struct slab_block))
+/* Blocks are carved out of the area this many bytes at a time, all of one class */
+#define SLAB_CHUNK (1u << 16)
+
+/*
+ * Header of every block - value bytes follow it
+ * refs and cls stay where they are while the block is free, and the area
+ * is never unmapped, so a stale handle can always be looked at safely:
+ * slab_tryget just fails on a block whose refs dropped to 0
+ */
+struct slab_block {
+    uint32_t refs;
+    uint32_t len;       /* bytes of value in data */
+    uint32_t next;      /* next free block of the class, while free */
+    uint32_t cls;
+    char data[];
+};
+
+/* Free list of a class - the handle of its first block in the low half and
+ * a count of pops in the high half, so a stale compare-and-swap cannot
+ * succeed after the list went A -> B -> A */
+struct __attribute__((aligned(64))) slab_class {
+    uint64_t head;
+    uint64_t chunks;    /* chunks carved for this class */
+};
+
+/*
+ * Allocator for values in the shared region - lives at the start of its
+ * area and is used by the client and the server at the same time, so it
+ * only has lock-free lists and no pointers, just handles (byte offsets from
+ * the header, which make 0 an invalid handle)
+ */
+struct __attribute__((aligned(64))) slab {
+    uint32_t magic;
+    uint32_t size;          /* bytes in the area, header included */
+    uint32_t next_chunk;    /* handle of the first byte not carved yet */
+    char pad[52];
+    struct slab_class classes[SLAB_CLASSES];
+};
+
+/* Set up an empty allocator over size bytes of zeroes at s - size < 4 GB
+ * @return 0 on success, -1 if size is too small or too large */
+int slab_init(struct slab *s, uint64_t size);
+
+/* @return 0 if s holds an allocator that fits in size bytes, -1 otherwise */
+int slab_check(struct slab *s, uint64_t size);
+
+/*
+ * Allocate a block for len bytes - thread-safe, across processes as well
+ * The caller holds the only reference
+ * @return the block's handle, 0 if the area is full or len too large
+ */
+uint32_t slab_alloc(struct slab *s, uint32_t len);
+
+/* Take another reference to h, unless its last one is gone already
+ * @return 1 if we got one */
+int slab_tryget(struct slab *s, uint32_t h);
+
+/*
+ * @return 1 if h is the handle of a block in a carved chunk, at a multiple
+ * of its class size, 0 otherwise - for handles that come from the other
+ * side of the shared region. size is what the caller knows to be mapped for
+ * the area: s->size lives in memory the other side can write.
+ */
+int slab_valid(struct slab *s, uint64_t size, uint32_t h);
+
+/* Drop a reference to h - the last one frees it */
+void slab_put(struct slab *s, uint32_t h);
+
+void slab_report(struct slab *s, FILE *out);
+
+static inline struct slab_block *slab_block(struct slab *s, uint32_t h) {
+    return (struct slab_block *)((char *)s + h);
+}
@@ -0,0 +1,173 @@
+#include "snapshot.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SNAPSHOT_MAGIC 0x31504e53564b7673ull  /* "skvSNP1" */
+#define SNAPSHOT_VERSION 2  /* 2: the header has wal_offset */
+// Pairs gathered before each write
+#define SNAPSHOT_BUF 4096
+
+struct snapshot_pair {
+    key_type k;
+    value_type v;
+};
+
+// Where snapshot_write is - lives on the stack, nothing is allocated
+struct snapshot_writer {
+    int fd;
+    uint32_t n;
+    uint64_t count;
+    uint64_t check;
+    struct snapshot_pair buf[SNAPSHOT_BUF];
+};
+
+static uint64_t check_pair(uint64_t check, key_type k, value_type v) {
+    return (check ^ hash_murmur3(k ^ hash_murmur3(v))) * 0x100000001b3ull;
+}
+
+static int write_all(int fd, const void *p, size_t n) {
+    while (n > 0) {
+        ssize_t done = write(fd, p, n);
+        if (done < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p = (const char *)p + done;
+        n -= done;
+    }
+    return 0;
+}
+
+static int writer_flush(struct snapshot_writer *w) {
+    int rc = write_all(w->fd, w->buf, w->n * sizeof(struct snapshot_pair));
+    w->n = 0;
+    return rc;
+}
+
+static int writer_add(key_type k, value_type v, void *arg) {
+    struct snapshot_writer *w = arg;
+
+    w->buf[w->n].k = k;
+    w->buf[w->n].v = v;
+    w->count++;
+    w->check = check_pair(w->check, k, v);
+    if (++w->n == SNAPSHOT_BUF)
+        return writer_flush(w);
+    return 0;
+}
+
+int snapshot_write(hash_table *t, const char *path, uint64_t wal_offset) {
+    struct snapshot_writer w = { .n = 0, .count = 0, .check = 0 };
+    struct snapshot_header hdr = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .pair_size = sizeof(struct snapshot_pair),
+        .wal_offset = wal_offset,
+    };
+    char tmp[PATH_MAX];
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((w.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0)
+        return -1;
+    // The header goes in last, once count and check are known
+    if (lseek(w.fd, sizeof(hdr), SEEK_SET) < 0 ||
+            ht_foreach(t, writer_add, &w) || writer_flush(&w))
+        goto fail;
+    hdr.count = w.count;
+    hdr.check = w.check;
+    if (pwrite(w.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fsync(w.fd))
+        goto fail;
+    close(w.fd);
+    return rename(tmp, path);
+
+fail:
+    close(w.fd);
+    unlink(tmp);
+    return -1;
+}
+
+static int read_header(int fd, struct snapshot_header *hdr, off_t size) {
+    if (pread(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr) ||
+            hdr->magic != SNAPSHOT_MAGIC || hdr->version != SNAPSHOT_VERSION ||
+            hdr->pair_size != sizeof(struct snapshot_pair) ||
+            (uint64_t)size != sizeof(*hdr) + hdr->count * sizeof(struct snapshot_pair)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int snapshot_count(const char *path, uint64_t *count, uint64_t *wal_offset) {
+    struct snapshot_header hdr;
+    struct stat st;
+    int fd, rc;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    if ((rc = fstat(fd, &st)) == 0 && (rc = read_header(fd, &hdr, st.st_size)) == 0) {
+        *count = hdr.count;
+        *wal_offset = hdr.wal_offset;
+    }
+    close(fd);
+    return rc;
+}
+
+int snapshot_set_wal_offset(const char *path, uint64_t wal_offset) {
+    struct snapshot_header hdr;
+    struct stat st;
+    int fd, rc;
+
+    if ((fd = open(path, O_RDWR)) < 0)
+        return -1;
+    if ((rc = fstat(fd, &st)) == 0 && (rc = read_header(fd, &hdr, st.st_size)) == 0) {
+        // The header fits in one sector, so it is never torn
+        hdr.wal_offset = wal_offset;
+        if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fsync(fd))
+            rc = -1;
+    }
+    close(fd);
+    return rc;
+}
+
+int64_t snapshot_load(hash_table *t, const char *path) {
+    struct snapshot_header hdr;
+    struct stat st;
+    char *map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(fd, &st) || read_header(fd, &hdr, st.st_size)) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    // Check everything before the table sees any of it
+    struct snapshot_pair *pairs = (struct snapshot_pair *)(map + sizeof(hdr));
+    uint64_t check = 0;
+    for (uint64_t i = 0; i < hdr.count; i++)
+        check = check_pair(check, pairs[i].k, pairs[i].v);
+    if (check != hdr.check) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    for (uint64_t i = 0; i < hdr.count; i++)
+        ht_put(t, pairs[i].k, pairs[i].v);
+    munmap(map, st.st_size);
+    return hdr.count;
+}
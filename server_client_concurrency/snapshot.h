@@ -0,0 +1,51 @@
+#pragma once
+#include <stdint.h>
+#include "common.h"
+#include "hash_table.h"
+
+/*
+ * A snapshot file is this header followed by count key/value pairs, in
+ * table order - check covers the pairs, so a torn or corrupt file is refused
+ */
+struct snapshot_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t pair_size;     /* sizeof(key_type) + sizeof(value_type) */
+    uint64_t count;
+    uint64_t check;
+    uint64_t wal_offset;    /* the pairs hold every record of the log before
+                               this offset, and none after it */
+};
+
+/*
+ * Write every entry of t to path, through a temporary file that is synced and
+ * renamed over path, so path always holds a complete snapshot - wal_offset
+ * is where the log was when t was copied, 0 without a log
+ * Reads the table without locking - meant for a forked child whose copy of
+ * the table nobody writes to. Allocates nothing, so it is safe to call after
+ * fork in a multithreaded process.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int snapshot_write(hash_table *t, const char *path, uint64_t wal_offset);
+
+/*
+ * Read the header of the snapshot at path, e.g. to size a table for it and
+ * to know where to replay the log from
+ * @return 0 on success, -1 with errno set if there is no valid snapshot
+ */
+int snapshot_count(const char *path, uint64_t *count, uint64_t *wal_offset);
+
+/*
+ * Change the log offset of the snapshot at path, and sync it - for a log
+ * that turned out shorter than the snapshot says, having lost records the
+ * snapshot already holds
+ * @return 0 on success, -1 with errno set on failure
+ */
+int snapshot_set_wal_offset(const char *path, uint64_t wal_offset);
+
+/*
+ * Insert every pair of the snapshot at path into t - caller must be online
+ * @return the number of pairs loaded, -1 with errno set on failure (t may
+ * hold part of the snapshot then)
+ */
+int64_t snapshot_load(hash_table *t, const char *path);
@@ -0,0 +1,50 @@
+#include "stats.h"
+#include <inttypes.h>
+
+uint64_t hist_bucket_high(int b) {
+    if (b < (1 << STATS_SUB_BITS))
+        return b;
+    int e = (b >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+    uint64_t width = 1ull << (e - STATS_SUB_BITS);
+    uint64_t low = ((1ull << STATS_SUB_BITS) + (b & ((1 << STATS_SUB_BITS) - 1))) * width;
+    return low + width - 1;
+}
+
+void hist_merge(struct lat_hist *dst, const struct lat_hist *src, int sign) {
+    // src may be live - the count is taken from the buckets read, so the
+    // histogram stays consistent with itself
+    uint64_t count = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        uint64_t n = STAT_READ(src->buckets[b]);
+        dst->buckets[b] += sign * n;
+        count += n;
+    }
+    dst->count += sign * count;
+    uint64_t max = STAT_READ(src->max);
+    if (max > dst->max)
+        dst->max = max;
+}
+
+uint64_t hist_percentile(const struct lat_hist *h, double p) {
+    uint64_t rank = (uint64_t)(p * h->count);
+    uint64_t seen = 0;
+
+    if (h->count == 0)
+        return 0;
+    if (rank >= h->count)
+        rank = h->count - 1;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > rank) {
+            uint64_t high = hist_bucket_high(b);
+            return high < h->max ? high : h->max;
+        }
+    }
+    return h->max;
+}
+
+void hist_print(const struct lat_hist *h, const char *name, FILE *out) {
+    fprintf(out, "%s: %" PRIu64 ", p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f us\n",
+            name, h->count, hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.9) / 1e3,
+            hist_percentile(h, 0.99) / 1e3, hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Server threads with a stats slot of their own */
+#define STATS_MAX_THREADS 128
+/* Each power of two is split into 2^STATS_SUB_BITS buckets, so a bucket is
+ * at most 1/8 of its values wide, and values stop at 2^STATS_MAX_EXP ns
+ * (about 18 minutes) */
+#define STATS_SUB_BITS 3
+#define STATS_MAX_EXP 40
+#define STATS_BUCKETS ((STATS_MAX_EXP - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+/* Counters another process reads while one thread writes them - relaxed
+ * stores, so a reader sees a recent whole value and the writer pays nothing */
+#define STAT_ADD(x, n) atomic_store_explicit(&(x), (x) + (n), memory_order_relaxed)
+#define STAT_READ(x) atomic_load_explicit(&(x), memory_order_relaxed)
+
+/* Log-bucketed latency histogram, in ns */
+struct lat_hist {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[STATS_BUCKETS];
+};
+
+/* Histograms of one kind of request */
+enum STATS_OP {
+    STATS_PUT = 0,  /* PUT, DEL and MPUT */
+    STATS_GET,      /* GET and MGET */
+    STATS_NUM_OPS
+};
+
+/* What one server thread counts, on cache lines of its own */
+struct __attribute__((aligned(64))) thread_stats {
+    uint64_t ops[STATS_NUM_OPS];    /* keys looked up or changed */
+    uint64_t requests;              /* descriptors, a vector counts once */
+    uint64_t batches;               /* times the thread took work off the ring */
+    uint64_t empty_waits;           /* ... and found none, and had to wait */
+    uint64_t lock_waits;            /* stripe locks it found held */
+    uint64_t busy_ns;               /* time spent on requests */
+    uint64_t idle_ns;               /* time spent waiting for them */
+    /* From the client's send to our dequeue, and from there to completion */
+    struct lat_hist queue[STATS_NUM_OPS];
+    struct lat_hist exec[STATS_NUM_OPS];
+};
+
+/*
+ * The stats region - the client appends it to the shared mapping (see
+ * ring->stats_off) and the server fills it in, so kvstat can watch the
+ * server from outside without a word from either
+ */
+struct stats_region {
+    uint32_t magic;
+    uint32_t num_threads;   /* server threads - set when the server starts */
+    uint64_t start_ns;      /* CLOCK_MONOTONIC when it did */
+    struct thread_stats threads[STATS_MAX_THREADS];
+};
+
+#define STATS_MAGIC 0x54415453u /* "STAT" */
+
+static inline uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline int hist_bucket(uint64_t ns) {
+    if (ns < (1u << STATS_SUB_BITS))
+        return ns;
+    if (ns >> STATS_MAX_EXP)
+        return STATS_BUCKETS - 1;
+    int e = 63 - __builtin_clzll(ns);
+    return ((e - STATS_SUB_BITS + 1) << STATS_SUB_BITS) +
+        ((ns >> (e - STATS_SUB_BITS)) & ((1u << STATS_SUB_BITS) - 1));
+}
+
+/* Add a sample - only one thread may add to h */
+static inline void hist_add(struct lat_hist *h, uint64_t ns) {
+    STAT_ADD(h->buckets[hist_bucket(ns)], 1);
+    STAT_ADD(h->count, 1);
+    if (ns > h->max)
+        atomic_store_explicit(&h->max, ns, memory_order_relaxed);
+}
+
+/* Largest value that lands in bucket b */
+uint64_t hist_bucket_high(int b);
+
+/* dst += src, or dst -= src with sign -1 (max is only ever raised) */
+void hist_merge(struct lat_hist *dst, const struct lat_hist *src, int sign);
+
+/* @return the value below which fraction p (0..1) of the samples lie, as the
+ * high end of its bucket - or the max, if that is lower */
+uint64_t hist_percentile(const struct lat_hist *h, double p);
+
+/* One line: count, p50, p90, p99, p99.9 and max in us */
+void hist_print(const struct lat_hist *h, const char *name, FILE *out);
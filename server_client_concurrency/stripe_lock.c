@@ -0,0 +1,71 @@
+#include "stripe_lock.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+__thread uint64_t stripe_waits;
+
+// Stripes listed individually in a report
+#define REPORT_TOP 8
+
+int stripes_init(struct stripe_set *ss, uint32_t num, enum STRIPE_KIND kind) {
+    uint32_t n = 1;
+    while (n < num)
+        n <<= 1;
+
+    if (posix_memalign((void **)&ss->stripes, 64, n * sizeof(struct stripe)))
+        return -1;
+    memset(ss->stripes, 0, n * sizeof(struct stripe));
+    ss->num = n;
+    ss->mask = n - 1;
+    ss->kind = kind;
+    if (kind == STRIPE_MUTEX) {
+        for (uint32_t i = 0; i < n; i++)
+            pthread_mutex_init(&ss->stripes[i].mutex, NULL);
+    }
+    return 0;
+}
+
+void stripes_destroy(struct stripe_set *ss) {
+    if (ss->kind == STRIPE_MUTEX) {
+        for (uint32_t i = 0; i < ss->num; i++)
+            pthread_mutex_destroy(&ss->stripes[i].mutex);
+    }
+    free(ss->stripes);
+    ss->stripes = NULL;
+}
+
+void stripes_report(struct stripe_set *ss, FILE *out) {
+    uint64_t acquired = 0, contended = 0;
+    uint32_t top[REPORT_TOP];
+    int ntop = 0;
+
+    for (uint32_t i = 0; i < ss->num; i++) {
+        struct stripe *st = &ss->stripes[i];
+        acquired += st->acquired;
+        contended += st->contended;
+
+        // Keep the REPORT_TOP most contended stripes, sorted descending
+        int j;
+        if (ntop < REPORT_TOP)
+            j = ntop++;
+        else if (ss->stripes[top[REPORT_TOP - 1]].contended < st->contended)
+            j = REPORT_TOP - 1;
+        else
+            continue;
+        while (j > 0 && ss->stripes[top[j - 1]].contended < st->contended) {
+            top[j] = top[j - 1];
+            j--;
+        }
+        top[j] = i;
+    }
+
+    fprintf(out, "lock stripes: %u x %s, %" PRIu64 " acquisitions, %" PRIu64 " contended (%.2f%%)\n",
+            ss->num, ss->kind == STRIPE_SPIN ? "spinlock" : "mutex",
+            acquired, contended, acquired ? 100.0 * contended / acquired : 0.0);
+    for (int j = 0; j < ntop && ss->stripes[top[j]].contended; j++) {
+        struct stripe *st = &ss->stripes[top[j]];
+        fprintf(out, "  stripe %u: %" PRIu64 " acquisitions, %" PRIu64 " contended (%.2f%%)\n", top[j],
+                st->acquired, st->contended, 100.0 * st->contended / st->acquired);
+    }
+}
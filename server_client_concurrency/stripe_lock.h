@@ -0,0 +1,86 @@
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include "futex.h"
+
+/* Spins on a held spinlock stripe before yielding the CPU */
+#define STRIPE_SPIN_LIMIT 256
+
+enum STRIPE_KIND {
+    STRIPE_MUTEX = 0,   /* pthread mutex - sleeps when contended */
+    STRIPE_SPIN         /* test-and-test-and-set spinlock - never sleeps */
+};
+
+/*
+ * One lock per cache line, so neighbouring stripes never false-share
+ * The counters are only written by the lock holder, so they need no atomics
+ */
+struct __attribute__((aligned(64))) stripe {
+    union {
+        pthread_mutex_t mutex;
+        uint32_t spin;
+    };
+    uint64_t acquired;      /* times this stripe was taken */
+    uint64_t contended;     /* ... of which it was already held */
+};
+
+struct stripe_set {
+    struct stripe *stripes;
+    uint32_t num;           /* power of two */
+    uint32_t mask;          /* num - 1 */
+    enum STRIPE_KIND kind;
+};
+
+/* Stripes the calling thread found held - for statistics */
+extern __thread uint64_t stripe_waits;
+
+/*
+ * Allocate and initialize num stripes (rounded up to a power of two)
+ * @return 0 on success, -1 if allocation failed
+ */
+int stripes_init(struct stripe_set *ss, uint32_t num, enum STRIPE_KIND kind);
+
+void stripes_destroy(struct stripe_set *ss);
+
+/*
+ * Print acquisition/contention totals and the most contended stripes
+ * Counters are read without taking the locks, so a report taken under load
+ * is approximate
+ */
+void stripes_report(struct stripe_set *ss, FILE *out);
+
+static inline void stripe_lock(struct stripe_set *ss, uint32_t i) {
+    struct stripe *st = &ss->stripes[i & ss->mask];
+    int contended = 0;
+
+    if (ss->kind == STRIPE_SPIN) {
+        int spins = 0;
+        while (atomic_exchange_explicit(&st->spin, 1, memory_order_acquire)) {
+            contended = 1;
+            while (atomic_load_explicit(&st->spin, memory_order_relaxed)) {
+                if (spins++ < STRIPE_SPIN_LIMIT)
+                    cpu_relax();
+                else
+                    sched_yield();
+            }
+        }
+    } else if (pthread_mutex_trylock(&st->mutex)) {
+        contended = 1;
+        pthread_mutex_lock(&st->mutex);
+    }
+    st->acquired++;
+    st->contended += contended;
+    stripe_waits += contended;
+}
+
+static inline void stripe_unlock(struct stripe_set *ss, uint32_t i) {
+    struct stripe *st = &ss->stripes[i & ss->mask];
+
+    if (ss->kind == STRIPE_SPIN)
+        atomic_store_explicit(&st->spin, 0, memory_order_release);
+    else
+        pthread_mutex_unlock(&st->mutex);
+}
@@ -0,0 +1,320 @@
+#include "wal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WAL_MAGIC 0x57414c31u   /* "WAL1" */
+// Records read at a time while replaying
+#define REPLAY_CHUNK 1024
+
+static const char *sync_names[] = { "none", "periodic", "group", "always" };
+
+static uint32_t record_check(const struct wal_record *rec) {
+    return hash_murmur3(rec->k ^ hash_murmur3(rec->v ^ hash_murmur3(rec->type))) ^ WAL_MAGIC;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Histogram bucket b holds values in [2^b, 2^(b+1)), bucket 0 also holds 0
+static int log2_bin(uint64_t x) {
+    int b = 0;
+    while (x > 1 && b < WAL_HIST_BINS - 1) {
+        x >>= 1;
+        b++;
+    }
+    return b;
+}
+
+// Grow an array of elem-sized items so it holds one more - exits on failure
+static void *grow(void *p, uint32_t n, uint32_t *cap, size_t elem) {
+    if (n < *cap)
+        return p;
+    *cap = *cap ? *cap * 2 : 256;
+    if ((p = realloc(p, *cap * elem)) == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    return p;
+}
+
+// A log we cannot write is a durability promise we cannot keep - give up
+static void write_all(int fd, const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t done = write(fd, p, n);
+        if (done < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("wal write");
+            exit(1);
+        }
+        p += done;
+        n -= done;
+    }
+}
+
+// Write b to the log
+static void buf_write(struct wal *w, struct wal_buf *b) {
+    write_all(w->fd, (const char *)b->recs, b->nrecs * sizeof(struct wal_record));
+}
+
+// Make everything written so far durable
+// @return how long fdatasync took, in ns
+static uint64_t log_sync(struct wal *w) {
+    uint64_t start = now_ns();
+    if (fdatasync(w->fd)) {
+        perror("fdatasync");
+        exit(1);
+    }
+    return now_ns() - start;
+}
+
+// Count a sync that took ns - caller holds the lock
+static void sync_done(struct wal *w, uint64_t ns) {
+    w->syncs++;
+    w->sync_ns += ns;
+    if (ns > w->sync_max_ns)
+        w->sync_max_ns = ns;
+    w->sync_hist[log2_bin(ns / 1000)]++;
+}
+
+// Count a write of b and empty it - caller holds the lock
+static void buf_done(struct wal *w, struct wal_buf *b) {
+    w->writes++;
+    w->records += b->nrecs;
+    w->write_hist[log2_bin(b->nrecs)]++;
+    b->nrecs = 0;
+    b->nwaiters = 0;
+}
+
+static void post_waiters(struct wal *w, struct wal_buf *b) {
+    for (uint32_t i = 0; i < b->nwaiters; i++)
+        ring_complete(w->ring, b->waiters[i].result, b->waiters[i].db);
+}
+
+// Writes out cur whenever there is something in it (or every period_ms)
+static void *committer_function(void *arg) {
+    struct wal *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    while (1) {
+        if (w->sync == WAL_SYNC_PERIODIC) {
+            pthread_mutex_unlock(&w->lock);
+            usleep(w->period_ms * 1000);
+            pthread_mutex_lock(&w->lock);
+        } else {
+            while (w->cur->nrecs == 0 && w->cur->nwaiters == 0)
+                pthread_cond_wait(&w->work, &w->lock);
+        }
+        if (w->cur->nrecs == 0 && w->cur->nwaiters == 0)
+            continue;
+
+        // Threads keep committing into the other buffer meanwhile
+        struct wal_buf *b = w->cur;
+        w->cur = b == &w->bufs[0] ? &w->bufs[1] : &w->bufs[0];
+        w->busy = 1;
+        pthread_mutex_unlock(&w->lock);
+
+        // Waiters without records of their own only wait for the buffer
+        // before, which is durable by now
+        int sync = w->sync != WAL_SYNC_NONE && b->nrecs;
+        uint64_t ns = 0;
+        if (b->nrecs)
+            buf_write(w, b);
+        if (sync)
+            ns = log_sync(w);
+        post_waiters(w, b);
+
+        pthread_mutex_lock(&w->lock);
+        if (b->nrecs)
+            buf_done(w, b);
+        b->nwaiters = 0;
+        if (sync)
+            sync_done(w, ns);
+        w->busy = 0;
+        pthread_cond_broadcast(&w->idle);
+    }
+    return NULL;
+}
+
+// Feed every intact record from offset from on to apply, then cut the log
+// after the last one
+static int replay(struct wal *w, uint64_t from, void (*apply)(const struct wal_record *rec)) {
+    struct wal_record recs[REPLAY_CHUNK];
+    off_t good = 0;
+    ssize_t n;
+
+    while ((n = read(w->fd, recs, sizeof(recs))) > 0) {
+        size_t count = n / sizeof(struct wal_record);
+        for (size_t i = 0; i < count; i++) {
+            if (recs[i].check != record_check(&recs[i]))
+                goto torn;
+            if ((uint64_t)good >= from)
+                apply(&recs[i]);
+            good += sizeof(struct wal_record);
+        }
+        // Only the end of the file can hold part of a record
+        if (n % sizeof(struct wal_record))
+            break;
+    }
+    if (n < 0)
+        return -1;
+torn:
+    if (ftruncate(w->fd, good) || lseek(w->fd, good, SEEK_SET) < 0)
+        return -1;
+    w->end = good;
+    return 0;
+}
+
+int wal_open(struct wal *w, const char *path, enum WAL_SYNC sync, int period_ms,
+        struct ring *ring, uint64_t from, void (*apply)(const struct wal_record *rec)) {
+    memset(w, 0, sizeof(struct wal));
+    w->sync = sync;
+    w->period_ms = period_ms > 0 ? period_ms : WAL_DEFAULT_PERIOD_MS;
+    w->ring = ring;
+    w->cur = &w->bufs[0];
+
+    if ((w->fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) < 0)
+        return -1;
+    if (replay(w, from, apply) < 0) {
+        close(w->fd);
+        return -1;
+    }
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->idle, NULL);
+    // Under WAL_SYNC_ALWAYS the committing threads write the log themselves
+    if (sync != WAL_SYNC_ALWAYS &&
+            (errno = pthread_create(&w->committer, NULL, &committer_function, w))) {
+        close(w->fd);
+        return -1;
+    }
+    return 0;
+}
+
+void wal_add(struct wal *w, enum REQUEST_TYPE type, key_type k, value_type v) {
+    struct wal_buf *b;
+    struct wal_record *rec;
+
+    pthread_mutex_lock(&w->lock);
+    b = w->cur;
+    b->recs = grow(b->recs, b->nrecs, &b->cap_recs, sizeof(struct wal_record));
+    rec = &b->recs[b->nrecs++];
+    rec->type = type;
+    rec->k = k;
+    rec->v = v;
+    rec->check = record_check(rec);
+    w->end += sizeof(struct wal_record);
+    pthread_mutex_unlock(&w->lock);
+}
+
+uint64_t wal_offset(struct wal *w) {
+    uint64_t end;
+
+    pthread_mutex_lock(&w->lock);
+    end = w->end;
+    pthread_mutex_unlock(&w->lock);
+    return end;
+}
+
+void wal_commit(struct wal *w, struct buffer_descriptor *result, struct completion_doorbell *db) {
+    struct wal_buf *b;
+    uint64_t ns;
+
+    pthread_mutex_lock(&w->lock);
+    b = w->cur;
+    switch (w->sync) {
+    case WAL_SYNC_GROUP:
+        // Nothing logged is waiting to be written - the commit is durable
+        if (b->nrecs == 0 && !w->busy)
+            break;
+        // The committer posts the completion after the sync that covers it
+        b->waiters = grow(b->waiters, b->nwaiters, &b->cap_waiters, sizeof(struct wal_waiter));
+        b->waiters[b->nwaiters].result = result;
+        b->waiters[b->nwaiters].db = db;
+        b->nwaiters++;
+        pthread_cond_signal(&w->work);
+        pthread_mutex_unlock(&w->lock);
+        return;
+    case WAL_SYNC_ALWAYS:
+        // Written under the lock, so records reach the file in log order, but
+        // synced outside it - one fdatasync covers whatever any thread wrote
+        // before it, and concurrent commits sync at the same time
+        if (b->nrecs) {
+            buf_write(w, b);
+            buf_done(w, b);
+        }
+        pthread_mutex_unlock(&w->lock);
+        ns = log_sync(w);
+        pthread_mutex_lock(&w->lock);
+        sync_done(w, ns);
+        break;
+    case WAL_SYNC_NONE:
+        if (b->nrecs)
+            pthread_cond_signal(&w->work);
+        break;
+    case WAL_SYNC_PERIODIC:
+        break;
+    }
+    pthread_mutex_unlock(&w->lock);
+    ring_complete(w->ring, result, db);
+}
+
+void wal_flush(struct wal *w) {
+    pthread_mutex_lock(&w->lock);
+    // Anything the committer is writing comes before cur in the log
+    while (w->busy)
+        pthread_cond_wait(&w->idle, &w->lock);
+    if (w->cur->nrecs) {
+        // Durable no matter the policy
+        buf_write(w, w->cur);
+        sync_done(w, log_sync(w));
+        post_waiters(w, w->cur);
+        buf_done(w, w->cur);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+int wal_parse_sync(const char *name) {
+    for (int i = 0; i < (int)(sizeof(sync_names) / sizeof(sync_names[0])); i++)
+        if (!strcmp(name, sync_names[i]))
+            return i;
+    return -1;
+}
+
+const char *wal_sync_name(enum WAL_SYNC sync) {
+    return sync_names[sync];
+}
+
+// One line per non-empty bucket, labelled with the bucket's range
+static void hist_report(const uint64_t *hist, const char *unit, FILE *out) {
+    for (int b = 0; b < WAL_HIST_BINS; b++) {
+        if (hist[b] == 0)
+            continue;
+        uint64_t lo = b ? (uint64_t)1 << b : 0;
+        uint64_t hi = ((uint64_t)2 << b) - 1;
+        fprintf(out, "    %8" PRIu64 " - %-8" PRIu64 " %s: %" PRIu64 "\n", lo, hi, unit, hist[b]);
+    }
+}
+
+void wal_report(struct wal *w, FILE *out) {
+    pthread_mutex_lock(&w->lock);
+    fprintf(out, "wal: %s sync, %" PRIu64 " records in %" PRIu64 " writes (%.1f records/write)\n",
+            wal_sync_name(w->sync), w->records, w->writes,
+            w->writes ? (double)w->records / w->writes : 0.0);
+    hist_report(w->write_hist, "records", out);
+    if (w->syncs) {
+        fprintf(out, "  %" PRIu64 " fdatasyncs, avg %.1f us, max %.1f us\n", w->syncs,
+                w->sync_ns / 1e3 / w->syncs, w->sync_max_ns / 1e3);
+        hist_report(w->sync_hist, "us", out);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
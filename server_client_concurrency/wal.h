@@ -0,0 +1,120 @@
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "common.h"
+#include "ring_buffer.h"
+
+/* Default fsync period of WAL_SYNC_PERIODIC, in milliseconds */
+#define WAL_DEFAULT_PERIOD_MS 10
+/* Log2 buckets of the commit size and fsync latency histograms */
+#define WAL_HIST_BINS 24
+
+/* When the log is made durable, and when a PUT is acknowledged */
+enum WAL_SYNC {
+    WAL_SYNC_NONE = 0,  /* written by the committer, never synced - acknowledged right away */
+    WAL_SYNC_PERIODIC,  /* synced every period_ms - acknowledged right away, so a crash
+                           loses up to one period */
+    WAL_SYNC_GROUP,     /* the committer syncs whatever piled up during the previous sync
+                           and acknowledges it afterwards */
+    WAL_SYNC_ALWAYS     /* every commit is written by the thread making it and synced,
+                           outside the lock, before it is acknowledged */
+};
+
+/* One logged mutation - check lets replay tell a torn tail from a record */
+struct wal_record {
+    uint32_t type;      /* PUT or DEL */
+    key_type k;
+    value_type v;
+    uint32_t check;
+};
+
+/* A completion to post once the commit holding its records is durable */
+struct wal_waiter {
+    struct buffer_descriptor *result;
+    struct completion_doorbell *db;
+};
+
+/* Records and waiters of the commits that are not on disk yet */
+struct wal_buf {
+    struct wal_record *recs;
+    uint32_t nrecs, cap_recs;
+    struct wal_waiter *waiters;
+    uint32_t nwaiters, cap_waiters;
+};
+
+/*
+ * Write-ahead log shared by all server threads
+ * Threads append to cur under lock, one record at a time; the committer
+ * thread swaps it with the empty spare, writes and syncs the spare outside
+ * the lock, and then posts its completions - so one fdatasync covers every
+ * commit made while the previous one was running.
+ */
+struct wal {
+    int fd;
+    enum WAL_SYNC sync;
+    int period_ms;
+    struct ring *ring;
+    pthread_t committer;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;    /* cur has records or waiters */
+    struct wal_buf bufs[2];
+    struct wal_buf *cur;
+
+    uint64_t end;           /* offset in the file after the last record of cur */
+    int busy;               /* the committer is writing a buffer outside the lock */
+    pthread_cond_t idle;    /* ... and is done with it */
+
+    /* Statistics, updated under lock */
+    uint64_t writes;
+    uint64_t syncs;
+    uint64_t records;
+    uint64_t write_hist[WAL_HIST_BINS];     /* records per write, log2 buckets */
+    uint64_t sync_ns;
+    uint64_t sync_max_ns;
+    uint64_t sync_hist[WAL_HIST_BINS];      /* fdatasync latency in us, log2 buckets */
+};
+
+/*
+ * Open (or create) the log at path, and hand every intact record already in
+ * it from offset from on to apply, in order - a torn record at the end is cut
+ * off. Then start the committer thread.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int wal_open(struct wal *w, const char *path, enum WAL_SYNC sync, int period_ms,
+        struct ring *ring, uint64_t from, void (*apply)(const struct wal_record *rec));
+
+/*
+ * Where the next record goes in the file, counting records not written yet
+ * Taken while no write can be halfway between the table and the log (e.g.
+ * with ht_lock_all), it says which records a copy of the table holds.
+ */
+uint64_t wal_offset(struct wal *w);
+
+/*
+ * Append one record - thread-safe, the log lock is only held for the append
+ * Call it while the key is still locked in the table (see ht_set_log), so
+ * the log order of two writes to one key is the order they were applied in.
+ */
+void wal_add(struct wal *w, enum REQUEST_TYPE type, key_type k, value_type v);
+
+/*
+ * A commit is the records a request added, e.g. the pairs of an MPUT - post
+ * (result, db) through ring_complete once they, and everything logged before
+ * them, are as durable as the sync policy promises. A commit may have no
+ * records at all.
+ * Records of concurrent commits interleave, so a crash may keep some of the
+ * records of a commit that was never acknowledged.
+ */
+void wal_commit(struct wal *w, struct buffer_descriptor *result, struct completion_doorbell *db);
+
+/* Write and sync everything logged so far - for a clean shutdown */
+void wal_flush(struct wal *w);
+
+/* Parse a sync policy name - @return the policy, or -1 */
+int wal_parse_sync(const char *name);
+const char *wal_sync_name(enum WAL_SYNC sync);
+
+/* Print how many records each write carried and how long fdatasync took */
+void wal_report(struct wal *w, FILE *out);
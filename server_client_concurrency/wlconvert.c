@@ -0,0 +1,108 @@
+/*
+ * Converts a text workload (workload.txt) or solution (solution.txt), as
+ * gen_workload.py writes them, into the binary format of workload.h that
+ * the client maps in place
+ * Invalid workload lines are skipped, as the client skips them
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "workload.h"
+
+#define LINE_LEN 256
+
+int solution = 0; /* -s: the input is a solution file */
+
+void usage(char *name) {
+	printf("Usage: %s [-h] [-s] input output\n", name);
+	printf("-h show this help\n");
+	printf("-s the input is a solution file, one get result per line (default: a workload file)\n");
+}
+
+static int parse_args(int argc, char **argv) {
+	int op;
+	while ((op = getopt(argc, argv, "hs")) != -1) {
+		switch (op) {
+		case 'h':
+		usage(argv[0]);
+		exit(EXIT_SUCCESS);
+		break;
+
+		case 's':
+		solution = 1;
+		break;
+
+		default:
+		usage(argv[0]);
+		return 1;
+		}
+	}
+	if (argc - optind != 2) {
+		usage(argv[0]);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Append a record for each line of in to out
+ * @return the number of records written, -1 on a write error
+ */
+int64_t convert(FILE *in, FILE *out) {
+	char line[LINE_LEN];
+	int64_t n = 0;
+
+	while (fgets(line, LINE_LEN, in) != NULL) {
+		struct request r;
+		value_type v;
+		size_t done;
+
+		if (solution) {
+			char *end;
+			v = strtoul(line, &end, 10);
+			if (end == line)
+				continue;
+			done = fwrite(&v, sizeof(v), 1, out);
+		} else {
+			if (wl_parse_line(line, &r) < 0)
+				continue;
+			done = fwrite(&r, sizeof(r), 1, out);
+		}
+		if (done != 1)
+			return -1;
+		n++;
+	}
+	return n;
+}
+
+int main(int argc, char *argv[]) {
+	enum WL_KIND kind;
+	FILE *in, *out;
+	int64_t n;
+
+	if (parse_args(argc, argv) != 0)
+		exit(EXIT_FAILURE);
+	kind = solution ? WL_SOLUTION : WL_REQUESTS;
+
+	if ((in = fopen(argv[optind], "r")) == NULL) {
+		perror(argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	if ((out = fopen(argv[optind + 1], "w")) == NULL) {
+		perror(argv[optind + 1]);
+		exit(EXIT_FAILURE);
+	}
+
+	/* The count is only known at the end - write the header again then */
+	if (wl_write_header(out, kind, 0) || (n = convert(in, out)) < 0 ||
+			wl_write_header(out, kind, n) || fclose(out)) {
+		perror(argv[optind + 1]);
+		exit(EXIT_FAILURE);
+	}
+	fclose(in);
+	printf("%" PRId64 " %s written to %s\n", n, solution ? "results" : "requests", argv[optind + 1]);
+	return 0;
+}
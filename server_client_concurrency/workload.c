@@ -0,0 +1,73 @@
+#include "workload.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define WL_MAGIC 0x314c574b56737673ull  /* "svsKVWL1" */
+
+static uint32_t record_size(enum WL_KIND kind) {
+	return kind == WL_REQUESTS ? sizeof(struct request) : sizeof(value_type);
+}
+
+void *wl_map(const char *path, enum WL_KIND kind, uint64_t *count) {
+	struct wl_header h;
+	struct stat st;
+	char *mem;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(h) ||
+			read(fd, &h, sizeof(h)) != sizeof(h) || h.magic != WL_MAGIC ||
+			h.kind != kind || h.record_size != record_size(kind) ||
+			h.count > (st.st_size - sizeof(h)) / h.record_size) {
+		close(fd);
+		return NULL;
+	}
+	// Fault everything in now rather than in the middle of a run
+	mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		return NULL;
+	*count = h.count;
+	return mem + sizeof(h);
+}
+
+int wl_write_header(FILE *f, enum WL_KIND kind, uint64_t count) {
+	struct wl_header h = { .magic = WL_MAGIC, .kind = kind,
+		.record_size = record_size(kind), .count = count };
+
+	if (fseek(f, 0, SEEK_SET) || fwrite(&h, sizeof(h), 1, f) != 1)
+		return -1;
+	return 0;
+}
+
+int wl_parse_line(const char *line, struct request *r) {
+	const char *p = line;
+	char *end;
+
+	if (!strncmp(p, PUT_STR " ", 4))
+		r->t = PUT;
+	else if (!strncmp(p, GET_STR " ", 4))
+		r->t = GET;
+	else if (!strncmp(p, DEL_STR " ", 4))
+		r->t = DEL;
+	else
+		return -1;
+
+	p += 4;
+	r->k = strtoul(p, &end, 10);
+	if (end == p)
+		return -1;
+	r->v = 0;
+	if (r->t == PUT) {
+		p = end;
+		r->v = strtoul(p, &end, 10);
+		if (end == p)
+			return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include "common.h"
+#include "ring_buffer.h"
+
+#define PUT_STR "put"
+#define GET_STR "get"
+#define DEL_STR "del"
+
+/* One request of a workload - t is PUT, GET or DEL, v is 0 unless a PUT */
+struct request {
+	key_type k;
+	value_type v;
+	enum REQUEST_TYPE t;
+};
+
+/* The format is shared with files on disk - nothing may move */
+_Static_assert(sizeof(struct request) == 12, "struct request is a file record");
+
+enum WL_KIND {
+	WL_REQUESTS = 1,	/* struct request records, like workload.txt */
+	WL_SOLUTION		/* one value_type per GET, like solution.txt */
+};
+
+/*
+ * A binary workload or solution file is this header followed by count
+ * records, in native byte order - the client maps it and uses the records
+ * where they lie, so there is nothing to parse
+ * Text files start with a request or a number, never with the magic
+ */
+struct wl_header {
+	uint64_t magic;
+	uint32_t kind;
+	uint32_t record_size;	/* sizeof(struct request) or sizeof(value_type) */
+	uint64_t count;
+};
+
+/*
+ * Map the binary file at path read-only, with its pages read in up front
+ * @return the first record, and the number of records in *count - NULL if
+ * path is not a binary file of this kind (it may be a text file)
+ */
+void *wl_map(const char *path, enum WL_KIND kind, uint64_t *count);
+
+/*
+ * Write the header for count records of kind at the start of f - the
+ * records follow it
+ * @return 0 on success, -1 otherwise
+ */
+int wl_write_header(FILE *f, enum WL_KIND kind, uint64_t count);
+
+/*
+ * Parse one line of a text workload ("put 4 5", "get 3", "del 3") into r
+ * The line is not modified
+ * @return 0 on success, -1 if it is not a request
+ */
+int wl_parse_line(const char *line, struct request *r);
@@ -0,0 +1,116 @@
+#pragma once
+#include <stdint.h>
+#include <math.h>
+
+/*
+ * Seedable random numbers and a bounded Zipf sampler for the benchmark tools
+ * Everything is computed from the seed alone, so two runs with the same seed
+ * produce the same sequence. The integers and doubles of the rng are exact,
+ * so they are the same on every machine. The Zipf sampler is not: it calls log, exp, log1p and
+ * expm1, which libm does not promise to round correctly, and glibc picks
+ * their implementation by CPU - so its samples can differ between libm
+ * versions and machines.
+ */
+
+/* xoshiro256** - seeded through splitmix64 as its authors recommend */
+struct rng {
+	uint64_t s[4];
+};
+
+static inline uint64_t splitmix64(uint64_t *x) {
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static inline void rng_seed(struct rng *r, uint64_t seed) {
+	for (int i = 0; i < 4; i++)
+		r->s[i] = splitmix64(&seed);
+}
+
+static inline uint64_t rng_next(struct rng *r) {
+	uint64_t *s = r->s;
+	uint64_t x = s[1] * 5;
+	uint64_t result = ((x << 7) | (x >> 57)) * 9;
+	uint64_t t = s[1] << 17;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = (s[3] << 45) | (s[3] >> 19);
+	return result;
+}
+
+/* Uniform double in [0, 1) */
+static inline double rng_double(struct rng *r) {
+	return (rng_next(r) >> 11) * 0x1.0p-53;
+}
+
+/* Uniform integer in [0, n) */
+static inline uint64_t rng_below(struct rng *r, uint64_t n) {
+	return (uint64_t)(((unsigned __int128)rng_next(r) * n) >> 64);
+}
+
+/*
+ * Zipf over 1..n with exponent s > 0 - P(k) is proportional to k^-s
+ * Rejection-inversion (Hormann & Derflinger, 1996): O(1) time and memory per
+ * sample for any n, no CDF table
+ */
+struct zipf {
+	uint64_t n;
+	double s;
+	double h_x1;	/* H(1.5) - 1 */
+	double h_n;	/* H(n + 0.5) */
+	double sq;	/* squeeze bound for the fast acceptance test */
+};
+
+/* log1p(x) / x, accurate near 0 */
+static inline double zipf_helper1(double x) {
+	return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+/* expm1(x) / x, accurate near 0 */
+static inline double zipf_helper2(double x) {
+	return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x * 0.5 * (1 + x * (1.0 / 3) * (1 + 0.25 * x));
+}
+
+/* Integral of x^-s */
+static inline double zipf_H(const struct zipf *z, double x) {
+	double lx = log(x);
+	return zipf_helper2((1 - z->s) * lx) * lx;
+}
+
+static inline double zipf_Hinv(const struct zipf *z, double x) {
+	double t = x * (1 - z->s);
+	if (t < -1)
+		t = -1;
+	return exp(zipf_helper1(t) * x);
+}
+
+static inline double zipf_h(const struct zipf *z, double x) {
+	return exp(-z->s * log(x));
+}
+
+static inline void zipf_init(struct zipf *z, uint64_t n, double s) {
+	z->n = n;
+	z->s = s;
+	z->h_x1 = zipf_H(z, 1.5) - 1;
+	z->h_n = zipf_H(z, n + 0.5);
+	z->sq = 2 - zipf_Hinv(z, zipf_H(z, 2.5) - zipf_h(z, 2));
+}
+
+static inline uint64_t zipf_next(const struct zipf *z, struct rng *r) {
+	while (1) {
+		double u = z->h_n + rng_double(r) * (z->h_x1 - z->h_n);
+		double x = zipf_Hinv(z, u);
+		uint64_t k = (uint64_t)(x + 0.5);
+		if (k < 1)
+			k = 1;
+		else if (k > z->n)
+			k = z->n;
+		if (k - x <= z->sq || u >= zipf_H(z, k + 0.5) - zipf_h(z, k))
+			return k;
+	}
+}